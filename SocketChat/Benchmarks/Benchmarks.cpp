@@ -0,0 +1,292 @@
+#include "../Logger.h"
+#include "../Packets/NetPacket.h"
+#include "../Packets/Protocol.h"
+#include "../Server/DatabaseInterface.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <new>
+
+// Microbenchmarks of the server's hot paths, run against the same packet and database code the server uses.
+// Usage: Benchmarks <directory for the database files> [benchmark...]; every benchmark runs when none is named.
+// Database files are created from scratch in the given directory, so it should be on the disk the server runs from.
+
+using BenchmarkClock = std::chrono::steady_clock;
+
+// Results of the measured code are stored here, so that the compiler can't leave the code out
+static volatile size_t benchmarkSink;
+
+static double GetElapsedMicroseconds(BenchmarkClock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(BenchmarkClock::now() - start).count();
+}
+
+// Opens a fresh database; the settings are the server's defaults unless overridden
+static std::unique_ptr<DatabaseInterface> CreateDatabase(const std::string& directory, const std::string& name, const std::string& synchronous = "FULL")
+{
+	DatabaseSettings settings;
+	settings.path = directory + "/" + name;
+	settings.synchronous = synchronous;
+
+	for (const char* suffix : { "", "-wal", "-shm" })
+	{
+		std::remove((settings.path + suffix).c_str());
+	}
+
+	return std::make_unique<DatabaseInterface>(settings);
+}
+
+// ============================= chatlist ==============================
+// Chat list of a user who takes part in ~200 of 20,000 chats (10 participants each), as sent on login and after every chat change
+
+static void Benchmark_ChatList(const std::string& directory)
+{
+	const int UserCount = 10000;
+	const int ChatCount = 20000;
+	const int ParticipantsPerChat = 10;
+	const int Iterations = 200;
+
+	// The setup doesn't need to be durable, so it isn't waiting for a sync on every commit
+	std::unique_ptr<DatabaseInterface> db = CreateDatabase(directory, "bench_chatlist.db", "OFF");
+
+	for (int i = 0; i < UserCount; ++i)
+	{
+		db->CreateUser("user" + std::to_string(i));
+	}
+
+	DatabaseUserInfo measuredUser;
+	db->GetUserByName("user0", &measuredUser);
+
+	uint32_t random = 1;
+	for (int chat = 0; chat < ChatCount; ++chat)
+	{
+		// The measured user takes part in every 100th chat, and in a few more by chance
+		std::vector<uint64_t> participants;
+		if (chat % 100 == 0)
+		{
+			participants.push_back(measuredUser.userId);
+		}
+
+		while (participants.size() < ParticipantsPerChat)
+		{
+			random = random * 1103515245 + 12345;
+			participants.push_back(measuredUser.userId + (random >> 8) % UserCount);
+
+			std::sort(participants.begin(), participants.end());
+			participants.erase(std::unique(participants.begin(), participants.end()), participants.end());
+		}
+
+		db->CreateChat(participants[0], participants, true);
+	}
+
+	// The server checkpoints the write-ahead log every few seconds, so reads don't have to search a long log
+	db->Checkpoint();
+
+	size_t chatCount = 0;
+	BenchmarkClock::time_point start = BenchmarkClock::now();
+	for (int i = 0; i < Iterations; ++i)
+	{
+		DatabaseChatRoomList chatList;
+		db->GetChatsForUser(measuredUser.userId, &chatList);
+		chatCount = chatList.chats.size();
+	}
+
+	printf("chatlist: %zu chats, %.1f us per chat list\n", chatCount, GetElapsedMicroseconds(start) / Iterations);
+}
+
+// ============================= groupcommit ==============================
+// Message throughput of the database thread by batch size: every batch is one commit, and so one sync of the log in FULL mode
+
+static void Benchmark_GroupCommit(const std::string& directory)
+{
+	const size_t MessageCount = 2048;
+
+	for (const char* synchronous : { "FULL", "NORMAL" })
+	{
+		for (size_t batchSize : { 1, 16, 256 })
+		{
+			std::unique_ptr<DatabaseInterface> db = CreateDatabase(directory, "bench_groupcommit.db", synchronous);
+			db->CreateUser("sender");
+
+			DatabaseUserInfo sender;
+			db->GetUserByName("sender", &sender);
+			uint64_t chatId = db->CreateChat(sender.userId, { sender.userId }, true);
+
+			BenchmarkClock::time_point start = BenchmarkClock::now();
+			for (size_t written = 0; written < MessageCount; written += batchSize)
+			{
+				std::vector<PendingChatMessage> batch(batchSize);
+				for (PendingChatMessage& pending : batch)
+				{
+					pending.chatId = chatId;
+					pending.senderId = sender.userId;
+					pending.filePromiseId = 0;
+					pending.message = "A chat message of a typical length, about sixty characters.";
+				}
+
+				db->AddChatMessages(batch);
+			}
+
+			double elapsedUs = GetElapsedMicroseconds(start);
+			printf("groupcommit: synchronous=%-6s batch %3zu: %9.0f messages/s, %7.1f us per commit\n",
+				synchronous, batchSize, MessageCount / (elapsedUs / 1000000.0), elapsedUs / (MessageCount / batchSize));
+		}
+	}
+}
+
+// ============================= decode ==============================
+// Decoding of a page of chat history (PKT_S2C_OpenChatAns, 50 messages) as the client receives it, by message length
+
+static PKT_S2C_OpenChatAns CreateHistoryPage(size_t messageLength)
+{
+	PKT_S2C_OpenChatAns pkt;
+	pkt.historyCursor = 1;
+
+	for (uint64_t i = 0; i < 50; ++i)
+	{
+		ChatMessage message;
+		message.author = i;
+		message.sentTimestamp = 1000 + i;
+		message.filePromiseId = 0;
+		message.message.assign(messageLength, (char)('a' + i % 26));
+
+		pkt.messages.push_back(std::move(message));
+	}
+
+	return pkt;
+}
+
+static void Benchmark_Decode(const std::string&)
+{
+	for (size_t messageLength : { 32, 512, 4096 })
+	{
+		std::unique_ptr<NetPacket> encoded = CreateHistoryPage(messageLength).Serialize();
+		NetPacket received = NetPacket::CreateView(encoded->GetData(), encoded->GetLength());
+
+		const int Iterations = 2000;
+
+		BenchmarkClock::time_point start = BenchmarkClock::now();
+		for (int i = 0; i < Iterations; ++i)
+		{
+			PKT_S2C_OpenChatAns pkt;
+			pkt.Decode(&received);
+			benchmarkSink = pkt.messages.back().message.size();
+		}
+
+		double perDecodeUs = GetElapsedMicroseconds(start) / Iterations;
+		printf("decode: messages of %4zu bytes, packet of %6zu bytes: %7.2f us per decode, %6.0f MB/s\n",
+			messageLength, received.GetLength(), perDecodeUs, received.GetLength() / perDecodeUs);
+	}
+}
+
+// ============================= serialize ==============================
+// Serializing a packet into a frame that is ready to be queued, with the heap allocations it makes
+
+// Every heap allocation of the process is counted, the benchmark looks at the difference
+static size_t allocationCount = 0;
+static size_t allocatedBytes = 0;
+
+void* operator new(size_t size)
+{
+	++allocationCount;
+	allocatedBytes += size;
+
+	void* memory = malloc(size);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+
+	return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+template <typename Packet>
+static void MeasureSerialization(const char* name, const Packet& pkt, int iterations)
+{
+	size_t allocationsBefore = allocationCount;
+	size_t bytesBefore = allocatedBytes;
+	size_t frameLength = NetFrame::Create(pkt.Serialize())->GetLength();
+	size_t frameAllocations = allocationCount - allocationsBefore;
+	size_t frameBytes = allocatedBytes - bytesBefore;
+
+	BenchmarkClock::time_point start = BenchmarkClock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		SharedNetFrame frame = NetFrame::Create(pkt.Serialize());
+		benchmarkSink = frame->GetLength();
+	}
+
+	printf("serialize: %-28s frame of %6zu bytes: %zu allocations, %6zu bytes allocated, %6.2f us per frame\n",
+		name, frameLength, frameAllocations, frameBytes, GetElapsedMicroseconds(start) / iterations);
+}
+
+static void Benchmark_Serialize(const std::string&)
+{
+	for (size_t messageLength : { 32, 512, 4096 })
+	{
+		std::string name = "OpenChatAns, 50 x " + std::to_string(messageLength) + " bytes";
+		MeasureSerialization(name.c_str(), CreateHistoryPage(messageLength), 2000);
+	}
+
+	PKT_C2S_SendMessage message;
+	message.message = "Hello there, how are you?";
+	MeasureSerialization("SendMessage, 25 bytes", message, 200000);
+}
+
+struct Benchmark {
+	const char* name;
+	std::function<void(const std::string& directory)> run;
+};
+
+int main(int argc, char* argv[])
+{
+	Logger::Initialize();
+
+	if (argc < 2)
+	{
+		printf("Usage: %s <directory for the database files> [benchmark...]\n", argv[0]);
+		return 1;
+	}
+
+	const Benchmark benchmarks[] = {
+		{ "chatlist", Benchmark_ChatList },
+		{ "groupcommit", Benchmark_GroupCommit },
+		{ "decode", Benchmark_Decode },
+		{ "serialize", Benchmark_Serialize },
+	};
+
+	std::string directory = argv[1];
+	for (const Benchmark& benchmark : benchmarks)
+	{
+		bool isSelected = argc == 2;
+		for (int i = 2; i < argc; ++i)
+		{
+			isSelected |= (strcmp(argv[i], benchmark.name) == 0);
+		}
+
+		if (isSelected)
+		{
+			benchmark.run(directory);
+		}
+	}
+
+	return 0;
+}
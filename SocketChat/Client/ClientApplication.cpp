@@ -66,11 +66,9 @@ void ClientSocketApp::SendNetEvent(std::unique_ptr<NetPacket> packet)
 {
 	EnterCriticalSection(&sendEventCS);
 
-	uint32_t packetSize = (uint32_t)packet->GetLength();
-
-	// send() here is blocking, so it waits until everything is sent
-	send(this->s, (const char*)&packetSize, sizeof(packetSize), 0);
-	send(this->s, (const char*)packet->GetData(), packetSize, 0);
+	// The packet already has room for its length prefix, so the whole frame goes out in a single send() (which is blocking here, so it waits until everything is sent)
+	std::vector<uint8_t> frame = packet->ReleaseFrame();
+	send(this->s, (const char*)frame.data(), (int)frame.size(), 0);
 
 	LeaveCriticalSection(&sendEventCS);
 }
@@ -264,6 +262,20 @@ void ClientSocketApp::OpenChatRoom(uint64_t chatID)
 	this->SendNetEvent(pkt.Serialize());
 }
 
+void ClientSocketApp::RequestChatHistory(uint64_t beforeMessageId)
+{
+	if (this->currentChatId == INVALID_CHAT_ID)
+	{
+		return;
+	}
+
+	PKT_C2S_RequestChatHistory pkt;
+	pkt.chatId = this->currentChatId;
+	pkt.beforeMessageId = beforeMessageId;
+
+	this->SendNetEvent(pkt.Serialize());
+}
+
 void ClientSocketApp::AddUserToChat(uint64_t userID)
 {
 	LogInfo("Adding user %I64u", userID);
@@ -28,6 +28,8 @@
 #define WM_CHATADDMSG (WM_APP + 4) // wParam: 0; lParam: pointer to PKT_S2C_NewMessage
 // Update the list of current chat's participants
 #define WM_REPLACEPARTICIPANTS (WM_APP + 5) // wParam: 0; lParam: pointer to PKT_S2C_ReplaceParticipantList
+// A page of older messages in the currently open chat arrived
+#define WM_CHATHISTORY (WM_APP + 6) // wParam: 0; lParam: pointer to PKT_S2C_ChatHistoryPage
 
 class NetPacket;
 class PKT_S2C_LoginAck;
@@ -35,12 +37,13 @@ class PKT_S2C_NewChat;
 class PKT_S2C_ResolveUsernameAns;
 class PKT_S2C_OpenChatAns;
 class PKT_S2C_NewMessage;
-class PKT_S2C_ChatReadReceipt;
+class PKT_S2C_ReadWatermark;
 class PKT_S2C_ReplaceChatList;
 class PKT_S2C_ReplaceParticipantList;
 class PKT_S2C_MessageBox;
 class PKT_S2C_StartTransmission;
 class PKT_S2C_ReceiveFileChunk;
+class PKT_S2C_ChatHistoryPage;
 
 struct UIVars {
 	HWND g_Window;
@@ -133,6 +136,7 @@ private:
 	void HandlePacket_MessageBox(PKT_S2C_MessageBox* packet);
 	void HandlePacket_StartTransmission(PKT_S2C_StartTransmission* packet);
 	void HandlePacket_ReceiveFileChunk(PKT_S2C_ReceiveFileChunk* packet);
+	void HandlePacket_ChatHistoryPage(PKT_S2C_ChatHistoryPage* packet);
 
 public:
 	ClientSocketApp();
@@ -143,6 +147,7 @@ public:
 	inline uint64_t GetUserIdInMenu(int idx) { return menuUserIdMapping[idx]; }
 	void CreateChatRoom(const std::vector<uint64_t>& userIDs, bool isGroupChat);
 	void OpenChatRoom(uint64_t chatID);
+	void RequestChatHistory(uint64_t beforeMessageId);
 	void AddUserToChat(uint64_t userID);
 	void RemoveUserFromChat(uint64_t userID);
 	void CreateFilePromise(const wchar_t* fullPath);
@@ -53,10 +53,21 @@ void ClientSocketApp::HandlePacket_ResolveUsernameAns(PKT_S2C_ResolveUsernameAns
 
 void ClientSocketApp::HandlePacket_OpenChatAns(PKT_S2C_OpenChatAns* packet)
 {
-	PKT_S2C_OpenChatAns* packetCopy = PKT_S2C_OpenChatAns::Deserialize(packet->Serialize().get()).release();
+	PKT_S2C_OpenChatAns* packetCopy = new PKT_S2C_OpenChatAns(*packet);
 	PostMessageW(ui.g_Window, WM_CHATOPEN, 0, (LPARAM)packetCopy);
 }
 
+void ClientSocketApp::HandlePacket_ChatHistoryPage(PKT_S2C_ChatHistoryPage* packet)
+{
+	if (packet->chatId != this->GetCurrentChatId())
+	{
+		return;
+	}
+
+	PKT_S2C_ChatHistoryPage* packetCopy = new PKT_S2C_ChatHistoryPage(*packet);
+	PostMessageW(ui.g_Window, WM_CHATHISTORY, 0, (LPARAM)packetCopy);
+}
+
 void ClientSocketApp::HandlePacket_NewMessage(PKT_S2C_NewMessage* packet)
 {
 	if (packet->chatId != this->GetCurrentChatId())
@@ -65,7 +76,7 @@ void ClientSocketApp::HandlePacket_NewMessage(PKT_S2C_NewMessage* packet)
 		return;
 	}
 
-	PKT_S2C_NewMessage* packetCopy = PKT_S2C_NewMessage::Deserialize(packet->Serialize().get()).release();
+	PKT_S2C_NewMessage* packetCopy = new PKT_S2C_NewMessage(*packet);
 	PostMessageW(ui.g_Window, WM_CHATADDMSG, 0, (LPARAM)packetCopy);
 }
 
@@ -101,7 +112,7 @@ void ClientSocketApp::HandlePacket_ReplaceChatList(PKT_S2C_ReplaceChatList* pack
 
 void ClientSocketApp::HandlePacket_ReplaceParticipantList(PKT_S2C_ReplaceParticipantList* packet)
 {
-	PKT_S2C_ReplaceParticipantList* packetCopy = PKT_S2C_ReplaceParticipantList::Deserialize(packet->Serialize().get()).release();
+	PKT_S2C_ReplaceParticipantList* packetCopy = new PKT_S2C_ReplaceParticipantList(*packet);
 	PostMessageW(ui.g_Window, WM_REPLACEPARTICIPANTS, 0, (LPARAM)packetCopy);
 }
 
@@ -133,14 +144,16 @@ void ClientSocketApp::HandlePacket_StartTransmission(PKT_S2C_StartTransmission*
 	LARGE_INTEGER fileSize = { 0 };
 	GetFileSizeEx(hUploadedFile, &fileSize);
 
-	PKT_C2S_SendFileChunk pkt;
-	pkt.fileData = std::vector<uint8_t>();
-	pkt.fileData.resize(fileSize.QuadPart);
+	std::vector<uint8_t> fileData;
+	fileData.resize(fileSize.QuadPart);
 
 	DWORD readBytes;
-	ReadFile(hUploadedFile, pkt.fileData.data(), fileSize.QuadPart, &readBytes, nullptr);
+	ReadFile(hUploadedFile, fileData.data(), fileSize.QuadPart, &readBytes, nullptr);
 	CloseHandle(hUploadedFile);
 
+	PKT_C2S_SendFileChunk pkt;
+	pkt.fileData = fileData;
+
 	cApp->SendNetEvent(pkt.Serialize());
 }
 
@@ -164,82 +177,24 @@ void ClientSocketApp::HandlePacket_ReceiveFileChunk(PKT_S2C_ReceiveFileChunk* pa
 
 void ClientSocketApp::NotifyNetworkEvent(std::unique_ptr<NetPacket> packet)
 {
+	// Every packet the server may send, along with its handler; the packet is decoded on the stack
+	using ServerPacketDispatcher = PacketDispatcher<
+		PacketHandler<&ClientSocketApp::HandlePacket_LoginAck>,
+		PacketHandler<&ClientSocketApp::HandlePacket_NewChat>,
+		PacketHandler<&ClientSocketApp::HandlePacket_ResolveUsernameAns>,
+		PacketHandler<&ClientSocketApp::HandlePacket_OpenChatAns>,
+		PacketHandler<&ClientSocketApp::HandlePacket_ChatHistoryPage>,
+		PacketHandler<&ClientSocketApp::HandlePacket_NewMessage>,
+		PacketHandler<&ClientSocketApp::HandlePacket_ReplaceChatList>,
+		PacketHandler<&ClientSocketApp::HandlePacket_ReplaceParticipantList>,
+		PacketHandler<&ClientSocketApp::HandlePacket_MessageBox>,
+		PacketHandler<&ClientSocketApp::HandlePacket_StartTransmission>,
+		PacketHandler<&ClientSocketApp::HandlePacket_ReceiveFileChunk>>;
+
 	if (packet->GetLength() == 0)
 	{
 		return;
 	}
 
-	switch ((PacketHeader)packet->GetData()[0])
-	{
-	case PacketHeader::S2C_LoginAck:
-	{
-		std::unique_ptr<PKT_S2C_LoginAck> pkt = PKT_S2C_LoginAck::Deserialize(packet.get());
-		this->HandlePacket_LoginAck(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_NewChat:
-	{
-		std::unique_ptr<PKT_S2C_NewChat> pkt = PKT_S2C_NewChat::Deserialize(packet.get());
-		this->HandlePacket_NewChat(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_ResolveUsernameAns:
-	{
-		std::unique_ptr<PKT_S2C_ResolveUsernameAns> pkt = PKT_S2C_ResolveUsernameAns::Deserialize(packet.get());
-		this->HandlePacket_ResolveUsernameAns(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_OpenChatAns:
-	{
-		std::unique_ptr<PKT_S2C_OpenChatAns> pkt = PKT_S2C_OpenChatAns::Deserialize(packet.get());
-		this->HandlePacket_OpenChatAns(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_NewMessage:
-	{
-		std::unique_ptr<PKT_S2C_NewMessage> pkt = PKT_S2C_NewMessage::Deserialize(packet.get());
-		this->HandlePacket_NewMessage(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_ReplaceChatList:
-	{
-		std::unique_ptr<PKT_S2C_ReplaceChatList> pkt = PKT_S2C_ReplaceChatList::Deserialize(packet.get());
-		this->HandlePacket_ReplaceChatList(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_ReplaceParticipantList:
-	{
-		std::unique_ptr<PKT_S2C_ReplaceParticipantList> pkt = PKT_S2C_ReplaceParticipantList::Deserialize(packet.get());
-		this->HandlePacket_ReplaceParticipantList(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_MessageBox:
-	{
-		std::unique_ptr<PKT_S2C_MessageBox> pkt = PKT_S2C_MessageBox::Deserialize(packet.get());
-		this->HandlePacket_MessageBox(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_StartTransmission:
-	{
-		std::unique_ptr<PKT_S2C_StartTransmission> pkt = PKT_S2C_StartTransmission::Deserialize(packet.get());
-		this->HandlePacket_StartTransmission(pkt.get());
-
-		break;
-	}
-	case PacketHeader::S2C_ReceiveFileChunk:
-	{
-		std::unique_ptr<PKT_S2C_ReceiveFileChunk> pkt = PKT_S2C_ReceiveFileChunk::Deserialize(packet.get());
-		this->HandlePacket_ReceiveFileChunk(pkt.get());
-
-		break;
-	}
-	}
+	ServerPacketDispatcher::Dispatch(this, (PacketHeader)packet->GetData()[0], packet.get());
 }
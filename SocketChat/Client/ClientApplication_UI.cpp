@@ -18,6 +18,7 @@
 #define ID_MENU_MEMBERS 102
 #define ID_MENU_ADD_MEMBER 103
 #define ID_MENU_RENAME_CHAT 104
+#define ID_MENU_LOAD_OLDER 105
 #define ID_MENU_REMOVE_USER_BASE 110
 
 using namespace std::string_literals;
@@ -29,6 +30,13 @@ using namespace std::string_literals;
 
 static std::unordered_map<LONG, uint64_t> linkFileIdMapping;
 
+// Messages of the open chat that have been received so far, and the cursor pointing at the older ones (0 if there are none)
+static std::vector<ChatMessage> loadedMessages;
+static uint64_t olderMessagesCursor = 0;
+
+// Cursor of the page of older messages that has been requested and hasn't arrived yet (0 if there is none), so that the same page isn't requested twice
+static uint64_t requestedHistoryCursor = 0;
+
 static uint64_t LinkToFilePromiseId(LONG linkBeginCharIdx)
 {
 	return linkFileIdMapping[linkBeginCharIdx];
@@ -87,6 +95,20 @@ static void AddMessageToChatbox(ChatMessage* msg)
 	cApp->UI_AppendChatText(L"\n", UI_CHATCOLOR_TEXT);
 }
 
+static void RedrawChatbox()
+{
+	SendMessageW(cApp->GetUI()->g_ChatContentsEdit, WM_SETREDRAW, FALSE, 0);
+	cApp->UI_ClearChatText();
+
+	for (size_t i = 0; i < loadedMessages.size(); ++i)
+	{
+		AddMessageToChatbox(&loadedMessages[i]);
+	}
+
+	SendMessageW(cApp->GetUI()->g_ChatContentsEdit, WM_SETREDRAW, TRUE, 0);
+	RedrawWindow(cApp->GetUI()->g_ChatContentsEdit, nullptr, nullptr, RDW_ERASE | RDW_FRAME | RDW_INVALIDATE | RDW_ALLCHILDREN);
+}
+
 void ClientSocketApp::SetChatReadState(uint64_t chatId, bool isRead)
 {
 	int selectedChat = SendMessageW(cApp->GetUI()->g_ChatListBox, LB_GETCURSEL, 0, 0);
@@ -208,6 +230,30 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 			return 0;
 		}
 
+		if (HIWORD(wParam) == 0 && LOWORD(wParam) == ID_MENU_LOAD_OLDER)
+		{
+			if (cApp->GetCurrentChatId() == INVALID_CHAT_ID)
+			{
+				MessageBoxW(cApp->GetUI()->g_Window, L"Please select a chat first.", L"Cannot load messages", MB_ICONWARNING | MB_OK);
+				return 0;
+			}
+
+			if (olderMessagesCursor == 0)
+			{
+				MessageBoxW(cApp->GetUI()->g_Window, L"All messages of this chat are already shown.", L"No older messages", MB_ICONINFORMATION | MB_OK);
+				return 0;
+			}
+
+			if (requestedHistoryCursor != 0)
+			{
+				return 0;
+			}
+
+			requestedHistoryCursor = olderMessagesCursor;
+			cApp->RequestChatHistory(olderMessagesCursor);
+			return 0;
+		}
+
 		if (HIWORD(wParam) == 0 && LOWORD(wParam) == ID_MENU_RENAME_CHAT)
 		{
 			if (cApp->GetCurrentChatId() == INVALID_CHAT_ID)
@@ -336,24 +382,34 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lPar
 	{
 		PKT_S2C_OpenChatAns* packet = (PKT_S2C_OpenChatAns*)lParam;
 
-		SendMessageW(cApp->GetUI()->g_ChatContentsEdit, WM_SETREDRAW, FALSE, 0);
-		cApp->UI_ClearChatText();
+		loadedMessages = std::move(packet->messages);
+		olderMessagesCursor = packet->historyCursor;
+		requestedHistoryCursor = 0;
+		RedrawChatbox();
+
+		delete packet;
+		break;
+	}
+	case WM_CHATHISTORY:
+	{
+		PKT_S2C_ChatHistoryPage* packet = (PKT_S2C_ChatHistoryPage*)lParam;
 
-		for (size_t i = 0; i < packet->messages.size(); ++i)
+		// The chat may have been switched while the page was on its way, and only the page that has been requested last is shown
+		if (packet->chatId == cApp->GetCurrentChatId() && requestedHistoryCursor != 0 && packet->beforeMessageId == requestedHistoryCursor)
 		{
-			ChatMessage* msg = &packet->messages[i];
-			AddMessageToChatbox(msg);
+			loadedMessages.insert(loadedMessages.begin(), packet->messages.begin(), packet->messages.end());
+			olderMessagesCursor = packet->historyCursor;
+			requestedHistoryCursor = 0;
+			RedrawChatbox();
 		}
 
-		SendMessageW(cApp->GetUI()->g_ChatContentsEdit, WM_SETREDRAW, TRUE, 0);
-		RedrawWindow(cApp->GetUI()->g_ChatContentsEdit, nullptr, nullptr, RDW_ERASE | RDW_FRAME | RDW_INVALIDATE | RDW_ALLCHILDREN);
-
 		delete packet;
 		break;
 	}
 	case WM_CHATADDMSG:
 	{
 		PKT_S2C_NewMessage* packet = (PKT_S2C_NewMessage*)lParam;
+		loadedMessages.push_back(packet->message);
 		AddMessageToChatbox(&packet->message);
 
 		delete packet;
@@ -451,6 +507,7 @@ void ClientSocketApp::CreateGUI()
 	AppendMenuW(hSubMenu, MF_STRING, ID_MENU_ADD_MEMBER, L"Add chat member");
 	AppendMenuW(hSubMenu, MF_STRING, ID_MENU_SHOW_TIMESTAMPS, L"Show timestamps");
 	AppendMenuW(hSubMenu, MF_STRING, ID_MENU_RENAME_CHAT, L"Rename chat");
+	AppendMenuW(hSubMenu, MF_STRING, ID_MENU_LOAD_OLDER, L"Load older messages");
 	AppendMenuW(ui.g_Menu, MF_STRING | MF_POPUP, (UINT_PTR)hSubMenu, L"Chat");
 
 	HINSTANCE hInstance = GetModuleHandleA(nullptr);
@@ -603,7 +660,8 @@ void ClientSocketApp::UI_UpdateMembersList(DatabaseUserInfoLite* users, size_t u
 			std::wstring usernameWide = cApp->UI_UTF8ToWideString(cApp->UserIDToName(users[i].userId)) + L"(" + std::to_wstring(users[i].userId) + L")";
 			wchar_t buf[256] = { 0 };
 
-			tm* timeinfo = localtime((const time_t*)&users[i].lastSeen);
+			time_t lastSeenTime = (time_t)(users[i].lastSeen / 1000000); // microseconds
+			tm* timeinfo = localtime(&lastSeenTime);
 			wcsftime(buf, _countof(buf), L"Last seen: %Y-%m-%d %H:%M:%S", timeinfo);
 
 			HMENU hUserMenu = CreatePopupMenu();
@@ -3,53 +3,137 @@
 NetPacket::NetPacket()
 {
 	this->readIterator = 0;
-	this->data.reserve(128);
+	this->payloadOffset = sizeof(uint32_t);
+	this->viewData = nullptr;
+	this->viewLength = 0;
+	this->data.resize(sizeof(uint32_t));
+}
+
+NetPacket::NetPacket(size_t payloadLength)
+{
+	this->readIterator = 0;
+	this->payloadOffset = sizeof(uint32_t);
+	this->viewData = nullptr;
+	this->viewLength = 0;
+	this->data.reserve(sizeof(uint32_t) + payloadLength);
+	this->data.resize(sizeof(uint32_t));
 }
 
 NetPacket::NetPacket(unsigned char* buf, unsigned int length)
 {
 	this->readIterator = 0;
+	this->payloadOffset = 0;
+	this->viewData = nullptr;
+	this->viewLength = 0;
 	this->data.resize(length);
 	memcpy(this->data.data(), buf, length);
 }
 
+NetPacket::NetPacket(ViewTag, const uint8_t* buf, size_t length)
+{
+	this->readIterator = 0;
+	this->payloadOffset = 0;
+	this->viewData = buf;
+	this->viewLength = length;
+}
+
+NetPacket NetPacket::CreateView(const uint8_t* buf, size_t length)
+{
+	return NetPacket(ViewTag(), buf, length);
+}
+
 NetPacket::~NetPacket()
 {
 }
 
 std::string NetPacket::ReadString()
 {
-	int stringLength = this->ReadField<int>();
-	
-	std::string s;
-	s.resize(stringLength);
+	return std::string(this->ReadStringView());
+}
 
-	for (size_t i = 0; i < s.size(); ++i)
+std::string_view NetPacket::ReadStringView()
+{
+	int stringLength = this->ReadField<int>();
+	if (stringLength < 0)
 	{
-		s[i] = this->ReadField<char>();
+		throw std::out_of_range("Packet contains a string of negative length");
 	}
 
+	// The length is checked once, then the whole string is taken at once
+	this->EnsureRemaining(stringLength);
+
+	std::string_view s((const char*)this->GetData() + this->readIterator, stringLength);
+	this->readIterator += stringLength;
+
 	return s;
 }
 
-void NetPacket::WriteString(const std::string& s)
+void NetPacket::WriteString(std::string_view s)
+{
+	this->WriteField<int>((int)s.size());
+	this->WriteByteArray((const uint8_t*)s.data(), s.size());
+}
+
+void NetPacket::ReadByteArray(uint8_t* dataPtr, size_t size)
+{
+	this->EnsureRemaining(size);
+	memcpy(dataPtr, this->GetData() + readIterator, size);
+	readIterator += size;
+}
+
+ByteView NetPacket::ReadByteView(size_t size)
+{
+	this->EnsureRemaining(size);
+
+	ByteView bytes(this->GetData() + readIterator, size);
+	readIterator += size;
+
+	return bytes;
+}
+
+void NetPacket::WriteByteArray(const uint8_t* dataPtr, size_t size)
+{
+	size_t offset = this->data.size();
+	this->data.resize(offset + size);
+	memcpy(this->data.data() + offset, dataPtr, size);
+}
+
+std::vector<uint8_t> NetPacket::ReleaseFrame()
 {
-	this->WriteField<int>(s.size());
+	uint32_t packetLength = (uint32_t)this->GetLength();
 
-	for (size_t i = 0; i < s.size(); ++i)
+	std::vector<uint8_t> frame;
+	if (this->payloadOffset == sizeof(packetLength))
+	{
+		// Outgoing packets already have room for the prefix, so the buffer is handed over as it is
+		frame = std::move(this->data);
+	}
+	else
 	{
-		this->WriteField<char>(s[i]);
+		frame.resize(sizeof(packetLength) + packetLength);
+		memcpy(frame.data() + sizeof(packetLength), this->GetData(), packetLength);
 	}
+	memcpy(frame.data(), &packetLength, sizeof(packetLength));
+
+	// The packet is left empty, without room for a prefix (allocating that again would cost every sent packet a second allocation)
+	this->data.clear();
+	this->payloadOffset = 0;
+	this->viewData = nullptr;
+	this->viewLength = 0;
+	this->readIterator = 0;
+
+	return frame;
 }
 
-void NetPacket::ReadByteArray(uint8_t* dataPtr, size_t size)
+NetFrame::NetFrame(std::vector<uint8_t> frameData) : data(std::move(frameData))
+{
+}
+
+NetFrame::~NetFrame()
 {
-	memcpy(dataPtr, this->data.data() + readIterator, size);
-	readIterator += size;
 }
 
-void NetPacket::WriteByteArray(uint8_t* dataPtr, size_t size)
+std::shared_ptr<const NetFrame> NetFrame::Create(std::unique_ptr<NetPacket> packet)
 {
-	this->data.resize(this->data.size() + size);
-	memcpy(this->data.data() + this->data.size() - size, dataPtr, size);
+	return std::make_shared<const NetFrame>(packet->ReleaseFrame());
 }
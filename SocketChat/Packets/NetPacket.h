@@ -1,39 +1,79 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <cstring>
+#include <stdexcept>
 
 template <typename T>
 struct is_serializable : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
 
+// A non-owning view of a byte array, e.g. inside a packet that is being read. It's only valid as long as the underlying buffer is.
+class ByteView {
+private:
+	const uint8_t* ptr;
+	size_t length;
+
+public:
+	ByteView() : ptr(nullptr), length(0) {}
+	ByteView(const uint8_t* ptr, size_t length) : ptr(ptr), length(length) {}
+	ByteView(const std::vector<uint8_t>& bytes) : ptr(bytes.data()), length(bytes.size()) {}
+
+	inline const uint8_t* data() const { return ptr; }
+	inline size_t size() const { return length; }
+};
+
 class NetPacket {
 private:
 	std::vector<uint8_t> data;
-	int readIterator;
+	size_t readIterator;
+
+	// Outgoing packets keep room for the frame length prefix in front of their payload, so that ReleaseFrame() doesn't have to copy it
+	size_t payloadOffset;
+
+	// Set for packets created by CreateView(), which read from a buffer they don't own (and can't be written to)
+	const uint8_t* viewData;
+	size_t viewLength;
+
+	struct ViewTag {};
+	NetPacket(ViewTag, const uint8_t* buf, size_t length);
 
 public:
 	NetPacket();
+	// Creates an outgoing packet whose buffer (length prefix included) is allocated once, for exactly payloadLength bytes
+	explicit NetPacket(size_t payloadLength);
 	NetPacket(unsigned char* buf, unsigned int length);
 	~NetPacket();
 
-	inline size_t GetLength() { return data.size(); }
-	inline uint8_t* GetData() { return data.data(); }
-	inline void SetReadIterator(int newIter) { readIterator = newIter; }
+	// Wraps a received packet without copying it. The packet, and every string or byte view read from it, is only valid as long as buf is.
+	static NetPacket CreateView(const uint8_t* buf, size_t length);
+
+	inline size_t GetLength() { return viewData ? viewLength : data.size() - payloadOffset; }
+	inline const uint8_t* GetData() { return viewData ? viewData : data.data() + payloadOffset; }
+	inline void SetReadIterator(size_t newIter) { readIterator = newIter; }
+	inline size_t GetRemainingLength() { return readIterator < this->GetLength() ? this->GetLength() - readIterator : 0; }
+
+	// Throws std::out_of_range if fewer than size bytes are left to be read, so that a truncated packet is rejected as a whole
+	inline void EnsureRemaining(size_t size)
+	{
+		if (size > this->GetRemainingLength())
+		{
+			throw std::out_of_range("Packet is truncated");
+		}
+	}
 
 	template <typename T>
 	T ReadField()
 	{
 		static_assert(is_serializable<T>::value, "Deserialization to this type is unsupported");
 
-		unsigned char tmp[sizeof(T)];
-
-		for (int i = 0; i < sizeof(T); ++i)
-		{
-			tmp[i] = data.at(readIterator++);
-		}
+		this->EnsureRemaining(sizeof(T));
 
 		T retval;
-		memcpy(&retval, tmp, sizeof(T));
+		memcpy(&retval, this->GetData() + readIterator, sizeof(T));
+		readIterator += sizeof(T);
 
 		return retval;
 	}
@@ -43,18 +83,50 @@ public:
 	{
 		static_assert(is_serializable<T>::value, "Serialization of this type is unsupported");
 
-		unsigned char tmp[sizeof(T)];
-		memcpy(tmp, &buf, sizeof(T));
+		size_t offset = data.size();
+		data.resize(offset + sizeof(T));
+		memcpy(data.data() + offset, &buf, sizeof(T));
+	}
 
-		for (int i = 0; i < sizeof(T); ++i)
-		{
-			data.push_back(tmp[i]);
-		}
+	// Encoded sizes of the values written by WriteField() and WriteString(), used to compute the exact size of a packet before writing it
+	template <typename T>
+	static constexpr size_t SizeOfField()
+	{
+		static_assert(is_serializable<T>::value, "Serialization of this type is unsupported");
+		return sizeof(T);
 	}
 
+	static inline size_t SizeOfString(std::string_view s) { return sizeof(int) + s.size(); }
+
 	std::string ReadString();
-	void WriteString(const std::string& s);
+	// Same as ReadString(), without copying the string out of the packet
+	std::string_view ReadStringView();
+	void WriteString(std::string_view s);
 
 	void ReadByteArray(uint8_t* data, size_t size);
-	void WriteByteArray(uint8_t* data, size_t size);
+	// Same as ReadByteArray(), without copying the bytes out of the packet
+	ByteView ReadByteView(size_t size);
+	void WriteByteArray(const uint8_t* data, size_t size);
+
+	// Fills in the length prefix and hands the whole buffer over, ready to be sent. The packet is empty afterwards and must not be written to again.
+	std::vector<uint8_t> ReleaseFrame();
 };
+
+// An immutable, length-prefixed packet that can be written to a socket as-is.
+// Frames are reference-counted, so a packet that is broadcast to many clients is serialized only once.
+class NetFrame {
+private:
+	std::vector<uint8_t> data;
+
+public:
+	// Takes a buffer that already starts with the length prefix, see NetPacket::ReleaseFrame()
+	NetFrame(std::vector<uint8_t> frameData);
+	~NetFrame();
+
+	inline size_t GetLength() const { return data.size(); }
+	inline const uint8_t* GetData() const { return data.data(); }
+
+	static std::shared_ptr<const NetFrame> Create(std::unique_ptr<NetPacket> packet);
+};
+
+using SharedNetFrame = std::shared_ptr<const NetFrame>;
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <tuple>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+
+#include "NetPacket.h"
+
+// Compile-time packet schemas: a packet lists its fields once, as member pointers, and its encoding, decoding,
+// exact encoded size and dispatch are all generated from that list. The wire format is the same as the one NetPacket writes by hand
+// (fields in declaration order, strings and arrays prefixed by their length).
+
+template <typename M>
+struct MemberPointerTraits;
+
+template <typename C, typename T>
+struct MemberPointerTraits<T C::*> {
+	using Owner = C;
+	using Type = T;
+};
+
+// How a single value of type T is encoded. MinSize is the smallest encoding of a value, used to reject
+// array lengths that cannot possibly fit into the rest of the packet before anything is allocated for them.
+template <typename T, typename Enable = void>
+struct FieldCodec;
+
+template <typename T>
+struct FieldCodec<T, std::enable_if_t<is_serializable<T>::value>> {
+	static constexpr size_t MinSize = sizeof(T);
+
+	static inline size_t Size(const T&) { return NetPacket::SizeOfField<T>(); }
+	static inline void Write(NetPacket* packet, const T& value) { packet->WriteField<T>(value); }
+	static inline void Read(NetPacket* packet, T& value) { value = packet->ReadField<T>(); }
+};
+
+template <>
+struct FieldCodec<std::string> {
+	static constexpr size_t MinSize = sizeof(int);
+
+	static inline size_t Size(const std::string& value) { return NetPacket::SizeOfString(value); }
+	static inline void Write(NetPacket* packet, const std::string& value) { packet->WriteString(value); }
+	static inline void Read(NetPacket* packet, std::string& value) { value = packet->ReadStringView(); }
+};
+
+// Points into the packet it was read from, see NetPacket::CreateView()
+template <>
+struct FieldCodec<std::string_view> {
+	static constexpr size_t MinSize = sizeof(int);
+
+	static inline size_t Size(std::string_view value) { return NetPacket::SizeOfString(value); }
+	static inline void Write(NetPacket* packet, std::string_view value) { packet->WriteString(value); }
+	static inline void Read(NetPacket* packet, std::string_view& value) { value = packet->ReadStringView(); }
+};
+
+// Same as std::string_view: a length followed by the bytes, read without copying them
+template <>
+struct FieldCodec<ByteView> {
+	static constexpr size_t MinSize = sizeof(size_t);
+
+	static inline size_t Size(const ByteView& value) { return NetPacket::SizeOfField<size_t>() + value.size(); }
+
+	static inline void Write(NetPacket* packet, const ByteView& value)
+	{
+		packet->WriteField<size_t>(value.size());
+		packet->WriteByteArray(value.data(), value.size());
+	}
+
+	static inline void Read(NetPacket* packet, ByteView& value)
+	{
+		size_t size = packet->ReadField<size_t>();
+		value = packet->ReadByteView(size);
+	}
+};
+
+// Arrays are an element count followed by the elements; arrays of plain values are copied as a whole
+template <typename T>
+struct FieldCodec<std::vector<T>> {
+	static constexpr size_t MinSize = sizeof(size_t);
+
+	static size_t Size(const std::vector<T>& value)
+	{
+		size_t size = NetPacket::SizeOfField<size_t>();
+		if constexpr (is_serializable<T>::value)
+		{
+			size += value.size() * sizeof(T);
+		}
+		else
+		{
+			for (const T& element : value)
+			{
+				size += FieldCodec<T>::Size(element);
+			}
+		}
+
+		return size;
+	}
+
+	static void Write(NetPacket* packet, const std::vector<T>& value)
+	{
+		packet->WriteField<size_t>(value.size());
+		if constexpr (is_serializable<T>::value)
+		{
+			packet->WriteByteArray((const uint8_t*)value.data(), value.size() * sizeof(T));
+		}
+		else
+		{
+			for (const T& element : value)
+			{
+				FieldCodec<T>::Write(packet, element);
+			}
+		}
+	}
+
+	static void Read(NetPacket* packet, std::vector<T>& value)
+	{
+		static_assert(FieldCodec<T>::MinSize > 0, "Array elements must have a non-empty encoding");
+
+		size_t count = packet->ReadField<size_t>();
+		if (count > packet->GetRemainingLength() / FieldCodec<T>::MinSize)
+		{
+			throw std::out_of_range("Packet is truncated");
+		}
+
+		value.resize(count);
+		if constexpr (is_serializable<T>::value)
+		{
+			packet->ReadByteArray((uint8_t*)value.data(), count * sizeof(T));
+		}
+		else
+		{
+			for (T& element : value)
+			{
+				FieldCodec<T>::Read(packet, element);
+			}
+		}
+	}
+};
+
+// A member, encoded with the codec of its type
+template <auto Member>
+struct PacketField {
+	using Owner = typename MemberPointerTraits<decltype(Member)>::Owner;
+	using Type = typename MemberPointerTraits<decltype(Member)>::Type;
+
+	static constexpr size_t MinSize = FieldCodec<Type>::MinSize;
+
+	static inline size_t Size(const Owner& owner) { return FieldCodec<Type>::Size(owner.*Member); }
+	static inline void Write(NetPacket* packet, const Owner& owner) { FieldCodec<Type>::Write(packet, owner.*Member); }
+	static inline void Read(NetPacket* packet, Owner& owner) { FieldCodec<Type>::Read(packet, owner.*Member); }
+};
+
+// The first element of an array member, encoded on its own (without a count); reading it leaves the array with that single element.
+// Encoding an empty array throws std::out_of_range.
+template <auto Member>
+struct PacketFieldFront {
+	using Owner = typename MemberPointerTraits<decltype(Member)>::Owner;
+	using Type = typename MemberPointerTraits<decltype(Member)>::Type::value_type;
+
+	static constexpr size_t MinSize = FieldCodec<Type>::MinSize;
+
+	static inline const Type& Front(const Owner& owner)
+	{
+		if ((owner.*Member).empty())
+		{
+			throw std::out_of_range("Packet field has no element to encode");
+		}
+
+		return (owner.*Member)[0];
+	}
+
+	static inline size_t Size(const Owner& owner) { return FieldCodec<Type>::Size(Front(owner)); }
+	static inline void Write(NetPacket* packet, const Owner& owner) { FieldCodec<Type>::Write(packet, Front(owner)); }
+
+	static inline void Read(NetPacket* packet, Owner& owner)
+	{
+		(owner.*Member).resize(1);
+		FieldCodec<Type>::Read(packet, (owner.*Member)[0]);
+	}
+};
+
+// A field that is only present when a member that precedes it has the given value
+template <auto Condition, auto Value, typename Field>
+struct PacketFieldIf {
+	using Owner = typename Field::Owner;
+
+	static constexpr size_t MinSize = 0;
+
+	static inline size_t Size(const Owner& owner) { return owner.*Condition == Value ? Field::Size(owner) : 0; }
+
+	static inline void Write(NetPacket* packet, const Owner& owner)
+	{
+		if (owner.*Condition == Value)
+		{
+			Field::Write(packet, owner);
+		}
+	}
+
+	static inline void Read(NetPacket* packet, Owner& owner)
+	{
+		if (owner.*Condition == Value)
+		{
+			Field::Read(packet, owner);
+		}
+	}
+};
+
+// An ordered list of fields, making up a packet or a structure inside of one
+template <typename... Fields>
+struct PacketFields {
+	static constexpr size_t MinSize = (Fields::MinSize + ... + 0);
+
+	template <typename Owner>
+	static inline size_t Size(const Owner& owner) { return (Fields::Size(owner) + ... + 0); }
+
+	template <typename Owner>
+	static inline void Write(NetPacket* packet, const Owner& owner) { (Fields::Write(packet, owner), ...); }
+
+	// Fields are read in order, which the comma fold guarantees, so that conditions are known before the fields that depend on them
+	template <typename Owner>
+	static inline void Read(NetPacket* packet, Owner& owner) { (Fields::Read(packet, owner), ...); }
+};
+
+// Codec for structures that are sent inside packets (e.g. in arrays), described by their own field list
+template <typename T, typename Fields>
+struct StructCodec {
+	static constexpr size_t MinSize = Fields::MinSize;
+
+	static inline size_t Size(const T& value) { return Fields::Size(value); }
+	static inline void Write(NetPacket* packet, const T& value) { Fields::Write(packet, value); }
+	static inline void Read(NetPacket* packet, T& value) { Fields::Read(packet, value); }
+};
+
+// Base of every packet type T: a header followed by T::Fields. T has to be default constructible, so that it can be decoded on the stack.
+template <typename T, auto Header>
+class SchemaPacket {
+public:
+	using HeaderType = decltype(Header);
+	static constexpr HeaderType header = Header;
+
+	// Exact number of bytes Serialize() writes, header included
+	size_t GetSerializedSize() const
+	{
+		return NetPacket::SizeOfField<HeaderType>() + T::Fields::Size(static_cast<const T&>(*this));
+	}
+
+	std::unique_ptr<NetPacket> Serialize() const
+	{
+		std::unique_ptr<NetPacket> pkt = std::make_unique<NetPacket>(this->GetSerializedSize());
+
+		pkt->WriteField<HeaderType>(Header);
+		T::Fields::Write(pkt.get(), static_cast<const T&>(*this));
+
+		return pkt;
+	}
+
+	// Reads the fields (the header is skipped) into this packet. Throws std::out_of_range if the packet is truncated.
+	void Decode(NetPacket* packetData)
+	{
+		packetData->SetReadIterator(NetPacket::SizeOfField<HeaderType>());
+		T::Fields::Read(packetData, static_cast<T&>(*this));
+	}
+
+	static std::unique_ptr<T> Deserialize(NetPacket* packetData)
+	{
+		std::unique_ptr<T> pkt = std::make_unique<T>();
+		pkt->Decode(packetData);
+
+		return pkt;
+	}
+};
+
+template <typename M>
+struct PacketHandlerTraits;
+
+template <typename C, typename R, typename P>
+struct PacketHandlerTraits<R (C::*)(P*)> {
+	using Owner = C;
+	using Result = R;
+	using Packet = P;
+};
+
+// A member function that handles one packet type, e.g. PacketHandler<&RemoteClient::ProcessPacket_Login>
+template <auto Method>
+struct PacketHandler {
+	using Owner = typename PacketHandlerTraits<decltype(Method)>::Owner;
+	using Result = typename PacketHandlerTraits<decltype(Method)>::Result;
+	using Packet = typename PacketHandlerTraits<decltype(Method)>::Packet;
+
+	static constexpr size_t HeaderIndex = static_cast<size_t>(Packet::header);
+
+	// Decodes the packet on the stack and passes it to the handler
+	static Result Invoke(Owner* owner, NetPacket* packetData)
+	{
+		Packet pkt;
+		pkt.Decode(packetData);
+
+		return (owner->*Method)(&pkt);
+	}
+};
+
+// A table of packet handlers indexed by header, built at compile time from a list of handlers of the same class
+template <typename... Handlers>
+struct PacketDispatcher {
+	using FirstHandler = std::tuple_element_t<0, std::tuple<Handlers...>>;
+	using Owner = typename FirstHandler::Owner;
+	using Result = typename FirstHandler::Result;
+	using Header = typename FirstHandler::Packet::HeaderType;
+	using Invoker = Result (*)(Owner*, NetPacket*);
+
+	static_assert((std::is_same_v<typename Handlers::Owner, Owner> && ...), "All handlers must belong to the same class");
+	static_assert((std::is_same_v<typename Handlers::Result, Result> && ...), "All handlers must return the same type");
+
+	static constexpr size_t TableSize = std::max({ Handlers::HeaderIndex... }) + 1;
+
+	static constexpr std::array<Invoker, TableSize> CreateTable()
+	{
+		std::array<Invoker, TableSize> table = {};
+		((table[Handlers::HeaderIndex] = &Handlers::Invoke), ...);
+
+		return table;
+	}
+
+	static constexpr bool HasUniqueHeaders()
+	{
+		std::array<bool, TableSize> isUsed = {};
+		bool isUnique = true;
+		((isUnique = isUnique && !isUsed[Handlers::HeaderIndex], isUsed[Handlers::HeaderIndex] = true), ...);
+
+		return isUnique;
+	}
+
+	static_assert(HasUniqueHeaders(), "Every header can only have a single handler");
+
+	static constexpr std::array<Invoker, TableSize> table = CreateTable();
+
+	// Returns the handler of the header, or nullptr if there is none
+	static inline Invoker Find(Header header)
+	{
+		size_t index = static_cast<size_t>(header);
+		return index < TableSize ? table[index] : nullptr;
+	}
+
+	// Passes the packet to the handler of its header (and discards its result, if any). Returns false if there is none.
+	static bool Dispatch(Owner* owner, Header header, NetPacket* packetData)
+	{
+		Invoker invoker = Find(header);
+		if (!invoker)
+		{
+			return false;
+		}
+
+		invoker(owner, packetData);
+		return true;
+	}
+
+	// Same as above, for handlers that return a result
+	static bool Dispatch(Owner* owner, Header header, NetPacket* packetData, Result* result)
+	{
+		Invoker invoker = Find(header);
+		if (!invoker)
+		{
+			return false;
+		}
+
+		*result = invoker(owner, packetData);
+		return true;
+	}
+};
@@ -3,15 +3,16 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <string_view>
 
+#include "NetPacket.h"
+#include "PacketSchema.h"
 #include "../Server/DatabaseInterface.h"
 
 #define INVALID_USER_ID ((uint64_t)-1)
 #define INVALID_CHAT_ID ((uint64_t)-1)
 #define CURRENTLY_ONLINE ((uint64_t)-1)
 
-class NetPacket;
-
 enum class LoginResult : uint8_t {
 	Success = 0,
 	UsernameWrongLength = 1,
@@ -41,7 +42,7 @@ enum class PacketHeader : uint8_t {
 	C2S_SendMessage = 8,
 	S2C_NewMessage = 9,
 
-	S2C_ChatReadReceipt = 10,
+	S2C_ChatReadReceipt = 10, // no longer sent, replaced by S2C_ReadWatermark
 	S2C_ReplaceChatList = 11,
 	S2C_ReplaceParticipantList = 12,
 
@@ -56,6 +57,11 @@ enum class PacketHeader : uint8_t {
 
 	C2S_SendFileChunk = 19,
 	S2C_ReceiveFileChunk = 20,
+
+	C2S_RequestChatHistory = 21,
+	S2C_ChatHistoryPage = 22,
+
+	S2C_ReadWatermark = 23,
 };
 
 struct ChatRoomInfo {
@@ -63,183 +69,250 @@ struct ChatRoomInfo {
 	uint64_t id;
 };
 
-class PKT_C2S_Login {
+// Structures sent inside packets, in the order their fields are encoded
+
+template <>
+struct FieldCodec<ChatMessage> : StructCodec<ChatMessage, PacketFields<
+	PacketField<&ChatMessage::author>,
+	PacketField<&ChatMessage::sentTimestamp>,
+	PacketField<&ChatMessage::filePromiseId>,
+	PacketField<&ChatMessage::message>>> {};
+
+template <>
+struct FieldCodec<DatabaseChatRoomInfoLite> : StructCodec<DatabaseChatRoomInfoLite, PacketFields<
+	PacketField<&DatabaseChatRoomInfoLite::chatName>,
+	PacketField<&DatabaseChatRoomInfoLite::chatId>,
+	PacketField<&DatabaseChatRoomInfoLite::isUnread>>> {};
+
+template <>
+struct FieldCodec<DatabaseUserInfoLite> : StructCodec<DatabaseUserInfoLite, PacketFields<
+	PacketField<&DatabaseUserInfoLite::userId>,
+	PacketField<&DatabaseUserInfoLite::lastSeen>,
+	PacketField<&DatabaseUserInfoLite::hasReadChat>>> {};
+
+// Packets list their fields in the order they are encoded in; everything else is generated from that list, see PacketSchema.h
+
+class PKT_C2S_Login : public SchemaPacket<PKT_C2S_Login, PacketHeader::C2S_Login> {
 public:
 	std::string username;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_Login> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_Login::username>>;
 };
 
-class PKT_S2C_LoginAck {
+class PKT_S2C_LoginAck : public SchemaPacket<PKT_S2C_LoginAck, PacketHeader::S2C_LoginAck> {
 public:
 	LoginResult result;
 	uint64_t userId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_LoginAck> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_LoginAck::result>,
+		PacketFieldIf<&PKT_S2C_LoginAck::result, LoginResult::Success, PacketField<&PKT_S2C_LoginAck::userId>>>;
 };
 
-class PKT_C2S_CreateChat {
+class PKT_C2S_CreateChat : public SchemaPacket<PKT_C2S_CreateChat, PacketHeader::C2S_CreateChat> {
 public:
 	bool isGroupChat;
 	std::vector<uint64_t> userIDs;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_CreateChat> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_CreateChat::isGroupChat>,
+		PacketFieldIf<&PKT_C2S_CreateChat::isGroupChat, true, PacketField<&PKT_C2S_CreateChat::userIDs>>,
+		PacketFieldIf<&PKT_C2S_CreateChat::isGroupChat, false, PacketFieldFront<&PKT_C2S_CreateChat::userIDs>>>;
 };
 
-class PKT_S2C_NewChat {
+class PKT_S2C_NewChat : public SchemaPacket<PKT_S2C_NewChat, PacketHeader::S2C_NewChat> {
 public:
 	bool flashWindow;
 	std::string chatName;
 	uint64_t chatID;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_NewChat> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_NewChat::flashWindow>,
+		PacketField<&PKT_S2C_NewChat::chatID>,
+		PacketField<&PKT_S2C_NewChat::chatName>>;
 };
 
-class PKT_C2S_ResolveUsername {
+class PKT_C2S_ResolveUsername : public SchemaPacket<PKT_C2S_ResolveUsername, PacketHeader::C2S_ResolveUsername> {
 public:
 	bool resolveUsername; // if true, this->username is used; otherwise, this->userId is used
 	std::string username;
 	uint64_t userId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_ResolveUsername> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_ResolveUsername::resolveUsername>,
+		PacketFieldIf<&PKT_C2S_ResolveUsername::resolveUsername, true, PacketField<&PKT_C2S_ResolveUsername::username>>,
+		PacketFieldIf<&PKT_C2S_ResolveUsername::resolveUsername, false, PacketField<&PKT_C2S_ResolveUsername::userId>>>;
 };
 
-class PKT_S2C_ResolveUsernameAns {
+class PKT_S2C_ResolveUsernameAns : public SchemaPacket<PKT_S2C_ResolveUsernameAns, PacketHeader::S2C_ResolveUsernameAns> {
 public:
 	std::string username;
 	uint64_t userId; // INVALID_USER_ID if not found
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_ResolveUsernameAns> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ResolveUsernameAns::username>,
+		PacketField<&PKT_S2C_ResolveUsernameAns::userId>>;
 };
 
-class PKT_C2S_OpenChat {
+class PKT_C2S_OpenChat : public SchemaPacket<PKT_C2S_OpenChat, PacketHeader::C2S_OpenChat> {
 public:
 	uint64_t chatId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_OpenChat> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_OpenChat::chatId>>;
 };
 
-class PKT_S2C_OpenChatAns {
+class PKT_S2C_OpenChatAns : public SchemaPacket<PKT_S2C_OpenChatAns, PacketHeader::S2C_OpenChatAns> {
 public:
-	std::vector<ChatMessage> messages;
+	std::vector<ChatMessage> messages; // only the most recent page of the chat history
+	uint64_t historyCursor; // pass to PKT_C2S_RequestChatHistory to fetch older messages; 0 if there are none
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_OpenChatAns> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_OpenChatAns::messages>,
+		PacketField<&PKT_S2C_OpenChatAns::historyCursor>>;
 };
 
-class PKT_C2S_SendMessage {
+// Views point into the packet the message was deserialized from (or, when serializing, into the sender's string)
+class PKT_C2S_SendMessage : public SchemaPacket<PKT_C2S_SendMessage, PacketHeader::C2S_SendMessage> {
 public:
-	std::string message;
+	std::string_view message;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_SendMessage> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_SendMessage::message>>;
 };
 
-class PKT_S2C_NewMessage {
+class PKT_S2C_NewMessage : public SchemaPacket<PKT_S2C_NewMessage, PacketHeader::S2C_NewMessage> {
 public:
 	uint64_t chatId;
 	ChatMessage message;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_NewMessage> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_NewMessage::chatId>,
+		PacketField<&PKT_S2C_NewMessage::message>>;
 };
 
-class PKT_S2C_ChatReadReceipt {
+// A participant of a chat has read all messages up to (and including) lastReadMessageId
+class PKT_S2C_ReadWatermark : public SchemaPacket<PKT_S2C_ReadWatermark, PacketHeader::S2C_ReadWatermark> {
 public:
 	uint64_t chatId;
 	uint64_t userId;
+	uint64_t lastReadMessageId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_ChatReadReceipt> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ReadWatermark::chatId>,
+		PacketField<&PKT_S2C_ReadWatermark::userId>,
+		PacketField<&PKT_S2C_ReadWatermark::lastReadMessageId>>;
 };
 
-class PKT_S2C_ReplaceChatList {
+class PKT_S2C_ReplaceChatList : public SchemaPacket<PKT_S2C_ReplaceChatList, PacketHeader::S2C_ReplaceChatList> {
 public:
 	std::vector<DatabaseChatRoomInfoLite> rooms;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_ReplaceChatList> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ReplaceChatList::rooms>>;
 };
 
-class PKT_S2C_ReplaceParticipantList {
+class PKT_S2C_ReplaceParticipantList : public SchemaPacket<PKT_S2C_ReplaceParticipantList, PacketHeader::S2C_ReplaceParticipantList> {
 public:
 	std::vector<DatabaseUserInfoLite> users;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_ReplaceParticipantList> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ReplaceParticipantList::users>>;
 };
 
-class PKT_C2S_AddRemoveUser {
+class PKT_C2S_AddRemoveUser : public SchemaPacket<PKT_C2S_AddRemoveUser, PacketHeader::C2S_AddRemoveUser> {
 public:
 	uint64_t userId;
 	bool isRemoveAction;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_AddRemoveUser> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_AddRemoveUser::userId>,
+		PacketField<&PKT_C2S_AddRemoveUser::isRemoveAction>>;
 };
 
-class PKT_S2C_MessageBox {
+class PKT_S2C_MessageBox : public SchemaPacket<PKT_S2C_MessageBox, PacketHeader::S2C_MessageBox> {
 public:
 	std::string message;
 	bool isDisconnection;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_MessageBox> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_MessageBox::message>,
+		PacketField<&PKT_S2C_MessageBox::isDisconnection>>;
 };
 
-class PKT_C2S_RenameChat {
+class PKT_C2S_RenameChat : public SchemaPacket<PKT_C2S_RenameChat, PacketHeader::C2S_RenameChat> {
 public:
 	std::string newName;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_RenameChat> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_RenameChat::newName>>;
 };
 
-class PKT_C2S_FilePromise {
+class PKT_C2S_FilePromise : public SchemaPacket<PKT_C2S_FilePromise, PacketHeader::C2S_FilePromise> {
 public:
 	uint64_t promiseId;
 	std::string fileName;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_FilePromise> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_FilePromise::promiseId>,
+		PacketField<&PKT_C2S_FilePromise::fileName>>;
 };
 
-class PKT_C2S_RequestFile {
+class PKT_C2S_RequestFile : public SchemaPacket<PKT_C2S_RequestFile, PacketHeader::C2S_RequestFile> {
 public:
 	uint64_t promiseId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_RequestFile> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_RequestFile::promiseId>>;
 };
 
-class PKT_S2C_StartTransmission {
+class PKT_S2C_StartTransmission : public SchemaPacket<PKT_S2C_StartTransmission, PacketHeader::S2C_StartTransmission> {
 public:
 	uint64_t promiseId;
 	uint64_t targetUserId;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_StartTransmission> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_StartTransmission::promiseId>,
+		PacketField<&PKT_S2C_StartTransmission::targetUserId>>;
 };
 
-class PKT_C2S_SendFileChunk {
+class PKT_C2S_SendFileChunk : public SchemaPacket<PKT_C2S_SendFileChunk, PacketHeader::C2S_SendFileChunk> {
 public:
-	std::vector<uint8_t> fileData;
+	ByteView fileData;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_C2S_SendFileChunk> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_SendFileChunk::fileData>>;
 };
 
-class PKT_S2C_ReceiveFileChunk {
+class PKT_S2C_ReceiveFileChunk : public SchemaPacket<PKT_S2C_ReceiveFileChunk, PacketHeader::S2C_ReceiveFileChunk> {
 public:
-	std::vector<uint8_t> fileData;
+	ByteView fileData;
 
-	std::unique_ptr<NetPacket> Serialize();
-	static std::unique_ptr<PKT_S2C_ReceiveFileChunk> Deserialize(NetPacket* packetData);
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ReceiveFileChunk::fileData>>;
+};
+
+class PKT_C2S_RequestChatHistory : public SchemaPacket<PKT_C2S_RequestChatHistory, PacketHeader::C2S_RequestChatHistory> {
+public:
+	uint64_t chatId;
+	uint64_t beforeMessageId; // history cursor received in PKT_S2C_OpenChatAns or PKT_S2C_ChatHistoryPage
+
+	using Fields = PacketFields<
+		PacketField<&PKT_C2S_RequestChatHistory::chatId>,
+		PacketField<&PKT_C2S_RequestChatHistory::beforeMessageId>>;
+};
+
+class PKT_S2C_ChatHistoryPage : public SchemaPacket<PKT_S2C_ChatHistoryPage, PacketHeader::S2C_ChatHistoryPage> {
+public:
+	uint64_t chatId;
+	uint64_t beforeMessageId; // the cursor this page has been requested with
+	std::vector<ChatMessage> messages; // messages that directly precede the requested cursor, oldest first
+	uint64_t historyCursor; // 0 if there are no older messages
+
+	using Fields = PacketFields<
+		PacketField<&PKT_S2C_ChatHistoryPage::chatId>,
+		PacketField<&PKT_S2C_ChatHistoryPage::beforeMessageId>,
+		PacketField<&PKT_S2C_ChatHistoryPage::messages>,
+		PacketField<&PKT_S2C_ChatHistoryPage::historyCursor>>;
 };
@@ -0,0 +1,222 @@
+#include "ChatDirectory.h"
+#include "DatabaseInterface.h"
+#include "../Packets/Protocol.h"
+
+#include <algorithm>
+
+bool ChatDirectoryEntry::HasParticipant(uint64_t userId) const
+{
+	return std::binary_search(this->participants.begin(), this->participants.end(), userId);
+}
+
+bool ChatDirectoryEntry::HasRead(uint64_t userId) const
+{
+	auto position = std::lower_bound(this->participants.begin(), this->participants.end(), userId);
+	if (position == this->participants.end() || *position != userId)
+	{
+		return false;
+	}
+
+	return this->participantsLastRead[position - this->participants.begin()] >= this->lastMessageId;
+}
+
+ChatDirectory::ChatDirectory(DatabaseInterface* db) : db(db)
+{
+}
+
+const ChatDirectoryEntry* ChatDirectory::Find(uint64_t chatId)
+{
+	auto it = this->chats.find(chatId);
+	if (it != this->chats.end())
+	{
+		return it->second.get();
+	}
+
+	DatabaseChatRoomInfo chatInfo;
+	if (!this->db->GetChatById(chatId, &chatInfo))
+	{
+		return nullptr;
+	}
+
+	return this->Insert(chatInfo);
+}
+
+const ChatDirectoryEntry* ChatDirectory::FindCached(uint64_t chatId)
+{
+	auto it = this->chats.find(chatId);
+	if (it == this->chats.end())
+	{
+		return nullptr;
+	}
+
+	return it->second.get();
+}
+
+ChatDirectoryEntry* ChatDirectory::Insert(DatabaseChatRoomInfo& chatInfo)
+{
+	// A chat that is already cached is replaced, together with its participants in the index
+	this->Erase(chatInfo.chatRoomId);
+
+	std::unique_ptr<ChatDirectoryEntry> entry = std::make_unique<ChatDirectoryEntry>();
+	entry->chatId = chatInfo.chatRoomId;
+	entry->ownerUserId = chatInfo.ownerUserId;
+	entry->chatName = std::move(chatInfo.chatName);
+	entry->isGroupChat = chatInfo.isGroupChat;
+	entry->participants = std::move(chatInfo.allParticipants);
+	entry->participantsLastRead = std::move(chatInfo.participantsLastRead);
+	entry->lastMessageId = chatInfo.lastMessageId;
+
+	ChatDirectoryEntry* result = entry.get();
+	this->chats[result->chatId] = std::move(entry);
+
+	for (uint64_t participantId : result->participants)
+	{
+		this->IndexParticipant(result->chatId, participantId);
+	}
+
+	return result;
+}
+
+void ChatDirectory::Erase(uint64_t chatId)
+{
+	auto it = this->chats.find(chatId);
+	if (it == this->chats.end())
+	{
+		return;
+	}
+
+	for (uint64_t participantId : it->second->participants)
+	{
+		this->UnindexParticipant(chatId, participantId);
+	}
+
+	this->chats.erase(it);
+}
+
+void ChatDirectory::IndexParticipant(uint64_t chatId, uint64_t userId)
+{
+	this->chatsByUser[userId].push_back(chatId);
+}
+
+void ChatDirectory::UnindexParticipant(uint64_t chatId, uint64_t userId)
+{
+	auto it = this->chatsByUser.find(userId);
+	if (it == this->chatsByUser.end())
+	{
+		return;
+	}
+
+	std::vector<uint64_t>& userChats = it->second;
+	auto position = std::find(userChats.begin(), userChats.end(), chatId);
+	if (position != userChats.end())
+	{
+		*position = userChats.back();
+		userChats.pop_back();
+	}
+
+	if (userChats.empty())
+	{
+		this->chatsByUser.erase(it);
+	}
+}
+
+const ChatDirectoryEntry* ChatDirectory::AddChat(DatabaseChatRoomInfo& chatInfo)
+{
+	return this->Insert(chatInfo);
+}
+
+void ChatDirectory::AddParticipant(uint64_t chatId, uint64_t userId)
+{
+	auto it = this->chats.find(chatId);
+	if (it != this->chats.end())
+	{
+		// New participants haven't read the chat yet
+		ChatDirectoryEntry* entry = it->second.get();
+		auto position = std::lower_bound(entry->participants.begin(), entry->participants.end(), userId);
+		if (position == entry->participants.end() || *position != userId)
+		{
+			entry->participantsLastRead.insert(entry->participantsLastRead.begin() + (position - entry->participants.begin()), 0);
+			entry->participants.insert(position, userId);
+			this->IndexParticipant(chatId, userId);
+		}
+	}
+}
+
+void ChatDirectory::RemoveParticipant(uint64_t chatId, uint64_t userId)
+{
+	auto it = this->chats.find(chatId);
+	if (it != this->chats.end())
+	{
+		ChatDirectoryEntry* entry = it->second.get();
+		auto position = std::lower_bound(entry->participants.begin(), entry->participants.end(), userId);
+		if (position != entry->participants.end() && *position == userId)
+		{
+			entry->participantsLastRead.erase(entry->participantsLastRead.begin() + (position - entry->participants.begin()));
+			entry->participants.erase(position);
+			this->UnindexParticipant(chatId, userId);
+		}
+	}
+}
+
+void ChatDirectory::RenameChat(uint64_t chatId, const std::string& newName)
+{
+	auto it = this->chats.find(chatId);
+	if (it != this->chats.end())
+	{
+		it->second->chatName = newName;
+	}
+}
+
+bool ChatDirectory::MarkRead(uint64_t chatId, uint64_t userId)
+{
+	auto it = this->chats.find(chatId);
+	if (it == this->chats.end())
+	{
+		return false;
+	}
+
+	ChatDirectoryEntry* entry = it->second.get();
+	auto position = std::lower_bound(entry->participants.begin(), entry->participants.end(), userId);
+	if (position == entry->participants.end() || *position != userId)
+	{
+		return false;
+	}
+
+	size_t index = position - entry->participants.begin();
+	if (entry->participantsLastRead[index] >= entry->lastMessageId)
+	{
+		return false;
+	}
+
+	entry->participantsLastRead[index] = entry->lastMessageId;
+	return true;
+}
+
+void ChatDirectory::SetLastMessage(uint64_t chatId, uint64_t messageId)
+{
+	auto it = this->chats.find(chatId);
+	if (it != this->chats.end())
+	{
+		it->second->lastMessageId = std::max(it->second->lastMessageId, messageId);
+	}
+}
+
+void ChatDirectory::EvictChatsOfUser(uint64_t userId, const std::function<bool(uint64_t userId)>& isOnline)
+{
+	auto indexed = this->chatsByUser.find(userId);
+	if (indexed == this->chatsByUser.end())
+	{
+		return;
+	}
+
+	// Evicting a chat removes it from the index, so the user's chats are walked on a copy
+	std::vector<uint64_t> userChats = indexed->second;
+	for (uint64_t chatId : userChats)
+	{
+		const ChatDirectoryEntry* chat = this->chats.at(chatId).get();
+		if (std::none_of(chat->participants.begin(), chat->participants.end(), isOnline))
+		{
+			this->Erase(chatId);
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class DatabaseInterface;
+struct DatabaseChatRoomInfo;
+
+// Cached metadata and membership of a single chat
+struct ChatDirectoryEntry {
+	uint64_t chatId;
+	uint64_t ownerUserId;
+	std::string chatName;
+	bool isGroupChat;
+	std::vector<uint64_t> participants; // sorted by user ID
+	std::vector<uint64_t> participantsLastRead; // read watermark (ID of the latest message read) of each participant, in the same order
+	uint64_t lastMessageId;
+
+	bool HasParticipant(uint64_t userId) const;
+	// A participant has read the chat if their watermark has reached the latest message
+	bool HasRead(uint64_t userId) const;
+};
+
+// In-memory directory of chats, so that routing a message to its participants doesn't have to query the database.
+// Chats are loaded on first use (through the network thread's connection, which only reads) and kept while some of their participants are online.
+// Only used on the network thread.
+// Changes to chats and their participants are written by the database thread, and applied to the directory once they have been committed.
+// Read state is the exception: it's changed here first, and written to the database by the caller in batches.
+class ChatDirectory {
+private:
+	DatabaseInterface* db;
+	std::unordered_map<uint64_t, std::unique_ptr<ChatDirectoryEntry>> chats;
+	// IDs of the cached chats of each user, so that a user's chats can be found without walking the whole directory
+	std::unordered_map<uint64_t, std::vector<uint64_t>> chatsByUser;
+
+	ChatDirectoryEntry* Insert(DatabaseChatRoomInfo& chatInfo);
+	void Erase(uint64_t chatId);
+
+	void IndexParticipant(uint64_t chatId, uint64_t userId);
+	void UnindexParticipant(uint64_t chatId, uint64_t userId);
+
+public:
+	ChatDirectory(DatabaseInterface* db);
+
+	ChatDirectory(const ChatDirectory&) = delete;
+	ChatDirectory& operator=(const ChatDirectory&) = delete;
+
+	// Returns nullptr if the chat doesn't exist. The entry stays valid until the chat is changed through the directory or evicted.
+	const ChatDirectoryEntry* Find(uint64_t chatId);
+	// Same as Find(), without loading the chat; returns nullptr if it isn't cached
+	const ChatDirectoryEntry* FindCached(uint64_t chatId);
+
+	// Adds a chat that has just been created (and read back) on the database thread
+	const ChatDirectoryEntry* AddChat(DatabaseChatRoomInfo& chatInfo);
+
+	// The following only update the cached copy of the chat (if it's cached), after the change has been committed
+	void AddParticipant(uint64_t chatId, uint64_t userId);
+	void RemoveParticipant(uint64_t chatId, uint64_t userId);
+	void RenameChat(uint64_t chatId, const std::string& newName);
+
+	// Moves the participant's read watermark to the latest message of the chat. Returns true if it has moved.
+	bool MarkRead(uint64_t chatId, uint64_t userId);
+	// Records a new message, which makes the chat unread for every participant whose watermark is below it
+	void SetLastMessage(uint64_t chatId, uint64_t messageId);
+
+	// Evicts the chats of a user who has gone offline, unless some of their other participants are still online
+	void EvictChatsOfUser(uint64_t userId, const std::function<bool(uint64_t userId)>& isOnline);
+};
@@ -3,7 +3,10 @@
 #include "../Packets/Protocol.h"
 
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
 #include <ctime>
+#include <chrono>
 
 // A helper function and a macro which asserts that an SQLite operation succeeds - if it fails, an exception is thrown.
 static inline bool ThrowHelper(const std::string& msg)
@@ -12,33 +15,331 @@ static inline bool ThrowHelper(const std::string& msg)
 }
 #define MUST_SUCCEED(x) (((x) == SQLITE_OK) || ThrowHelper("Statement [" _CRT_STRINGIZE(x) "] in " __FUNCTION__ " failed: " + std::string(sqlite3_errmsg(this->dbHandle))))
 
-DatabaseInterface::DatabaseInterface(const char* databasePath)
+// Same for writes: the statement must run to completion (e.g. not fail with SQLITE_BUSY), otherwise an exception is thrown and the enclosing transaction is rolled back
+#define MUST_COMPLETE(stmt) ((sqlite3_step(stmt) == SQLITE_DONE) || ThrowHelper("Statement [" + std::string(sqlite3_sql(stmt)) + "] in " __FUNCTION__ " failed: " + std::string(sqlite3_errmsg(this->dbHandle))))
+
+// Participants are added to a new chat ParticipantBatchSize at a time, with a single statement for each batch
+constexpr size_t ParticipantBatchSize = 64;
+#define SQL_PARAMS_8 "?, ?, ?, ?, ?, ?, ?, ?"
+#define SQL_PARAMS_64 SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8 ", " SQL_PARAMS_8
+
+// SQL text of every statement from DatabaseStatement, in the same order
+static const char* const StatementSQL[] = {
+	"BEGIN TRANSACTION", // BeginTransaction
+	"COMMIT", // CommitTransaction
+	"ROLLBACK", // RollbackTransaction
+	"SELECT name, lastSeen FROM users WHERE id = ?", // GetUserById
+	"SELECT id, lastSeen FROM users WHERE name = ?", // GetUserByName
+	"INSERT INTO users (name, lastSeen) VALUES (?, ?)", // CreateUser
+	"UPDATE users SET lastSeen = ? WHERE id = ?", // UpdateLastSeenTime
+	"SELECT chatId, name, lastReadMessageId < lastMessageId FROM users_in_chats INNER JOIN chats ON chatId = chats.id WHERE userId = ? ORDER BY chatId DESC", // GetChatsForUser
+	"INSERT INTO chats (isGroupChat, ownerUserId) VALUES (?, ?)", // CreateChat
+	"INSERT INTO users_in_chats (chatId, userId) VALUES (?, ?)", // AddChatParticipant
+	// Only existing users are inserted, so the number of inserted rows also validates the whole batch
+	"INSERT INTO users_in_chats (chatId, userId) SELECT ?, id FROM users WHERE id IN (" SQL_PARAMS_64 ")", // AddChatParticipants
+	"SELECT name, isGroupChat, ownerUserId, lastMessageId FROM chats WHERE id = ?", // GetChatById
+	"SELECT userId, lastReadMessageId FROM users_in_chats WHERE chatId = ? ORDER BY userId", // GetChatParticipants
+	"SELECT userId, lastSeen, lastReadMessageId >= lastMessageId FROM users_in_chats INNER JOIN users ON userId = users.id INNER JOIN chats ON chatId = chats.id "
+		"WHERE chatId = ? ORDER BY users.name ASC", // GetUsersInChat
+	"UPDATE chats SET name = ? WHERE id = ?", // RenameChat
+	"SELECT id, senderId, content, sentTime, filePromiseId FROM messages WHERE chatId = ? AND id < ? ORDER BY id DESC LIMIT ?", // GetChatMessages
+	"INSERT INTO messages (chatId, senderId, content, filePromiseId, sentTime) VALUES (?, ?, ?, ?, ?)", // AddChatMessage
+	"UPDATE chats SET lastMessageId = ? WHERE id = ?", // SetChatLastMessage
+	"UPDATE users_in_chats SET lastReadMessageId = MAX(lastReadMessageId, ?) WHERE chatId = ? AND userId = ?", // AdvanceReadWatermark
+	"DELETE FROM users_in_chats WHERE chatId = ? AND userId = ?", // RemoveUserFromChat
+};
+static_assert(sizeof(StatementSQL) / sizeof(StatementSQL[0]) == (size_t)DatabaseStatement::Count, "StatementSQL does not match DatabaseStatement");
+
+// Returns the current time as microseconds since the Unix epoch
+static uint64_t GetCurrentTimestamp()
 {
-	if (sqlite3_open(databasePath, &this->dbHandle) != SQLITE_OK)
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Borrows a cached statement for the duration of a scope. The statement is reset (and its bindings cleared) when the scope ends,
+// even if an exception was thrown, so that it's ready to be used again.
+class ScopedStatement {
+private:
+	sqlite3_stmt* stmt;
+
+public:
+	ScopedStatement(sqlite3_stmt* stmt) : stmt(stmt) {}
+	~ScopedStatement()
+	{
+		sqlite3_reset(this->stmt);
+		sqlite3_clear_bindings(this->stmt);
+	}
+
+	ScopedStatement(const ScopedStatement&) = delete;
+	ScopedStatement& operator=(const ScopedStatement&) = delete;
+
+	inline operator sqlite3_stmt*() { return this->stmt; }
+};
+
+// Groups all statements executed during its lifetime into a single transaction (and a single commit). Transactions may be nested,
+// in which case only the outermost one commits. If the scope is left without calling Commit() (e.g. due to an exception), the transaction is rolled back.
+class DatabaseTransaction {
+private:
+	DatabaseInterface* db;
+	bool isFinished;
+
+public:
+	DatabaseTransaction(DatabaseInterface* db) : db(db), isFinished(false)
+	{
+		this->db->BeginTransaction();
+	}
+
+	~DatabaseTransaction()
+	{
+		if (!this->isFinished)
+		{
+			this->db->RollbackTransaction();
+		}
+	}
+
+	DatabaseTransaction(const DatabaseTransaction&) = delete;
+	DatabaseTransaction& operator=(const DatabaseTransaction&) = delete;
+
+	void Commit()
+	{
+		this->db->CommitTransaction();
+		this->isFinished = true;
+	}
+};
+
+DatabaseInterface::DatabaseInterface(const DatabaseSettings& settings)
+{
+	this->transactionDepth = 0;
+
+	if (sqlite3_open(settings.path.c_str(), &this->dbHandle) != SQLITE_OK)
 	{
 		throw std::runtime_error("Cannot open database");
 	}
 
-	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE TABLE IF NOT EXISTS users(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, lastSeen TEXT NOT NULL DEFAULT CURRENT_TIMESTAMP)",
+	// The network thread and the database thread have separate connections. All writes go through the database thread, so this only
+	// makes its writes wait for a checkpoint or another process instead of failing; the network thread's reads are never blocked in WAL mode.
+	sqlite3_busy_timeout(this->dbHandle, 5000);
+
+	this->ApplySettings(settings);
+	this->ApplyMigrations();
+	this->PrepareStatements();
+}
+
+DatabaseInterface::~DatabaseInterface()
+{
+	for (sqlite3_stmt* stmt : this->statements)
+	{
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_close(this->dbHandle);
+}
+
+void DatabaseInterface::ApplySettings(const DatabaseSettings& settings)
+{
+	// With a write-ahead log, readers don't block the writer (and vice versa), and a commit appends to the log instead of rewriting pages
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "PRAGMA journal_mode = WAL", nullptr, nullptr, nullptr));
+
+	// Checkpoints are run periodically by the server (see Checkpoint()), never inline by whichever connection happens to commit
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "PRAGMA wal_autocheckpoint = 0", nullptr, nullptr, nullptr));
+
+	std::string pragmas = "PRAGMA synchronous = " + settings.synchronous + ";"
+		"PRAGMA cache_size = -" + std::to_string(settings.cacheSizeKb) + ";"
+		"PRAGMA mmap_size = " + std::to_string(settings.mmapSizeBytes) + ";"
+		"PRAGMA temp_store = " + (settings.tempStoreInMemory ? "MEMORY" : "DEFAULT") + ";";
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, pragmas.c_str(), nullptr, nullptr, nullptr));
+}
+
+int DatabaseInterface::GetSchemaVersion()
+{
+	int version = 0;
+
+	sqlite3_stmt* stmt;
+	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "PRAGMA user_version", -1, &stmt, nullptr));
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		version = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return version;
+}
+
+void DatabaseInterface::SetSchemaVersion(int version)
+{
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, ("PRAGMA user_version = " + std::to_string(version)).c_str(), nullptr, nullptr, nullptr));
+}
+
+bool DatabaseInterface::TableExists(const char* tableName)
+{
+	bool exists = false;
+
+	sqlite3_stmt* stmt;
+	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", -1, &stmt, nullptr));
+	MUST_SUCCEED(sqlite3_bind_text(stmt, 1, tableName, -1, SQLITE_STATIC));
+	exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+
+	return exists;
+}
+
+void DatabaseInterface::ApplyMigrations()
+{
+	// The schema version is stored in PRAGMA user_version; a database at version N is upgraded by running migrations N+1 onwards, in order.
+	// New migrations are only ever appended to this list, existing ones must not change.
+	static const struct {
+		const char* description;
+		void (DatabaseInterface::*apply)();
+	} migrations[] = {
+		{ "store timestamps as integers", &DatabaseInterface::MigrateToIntegerTimestamps }, // 1
+		{ "add secondary indexes", &DatabaseInterface::MigrateToSecondaryIndexes }, // 2
+		{ "replace read flags with read watermarks", &DatabaseInterface::MigrateToReadWatermarks }, // 3
+	};
+	const int latestVersion = (int)(sizeof(migrations) / sizeof(migrations[0]));
+
+	int version = this->GetSchemaVersion();
+	if (version > latestVersion)
+	{
+		ThrowHelper("Database schema version " + std::to_string(version) + " is newer than this server supports (" + std::to_string(latestVersion) + ")");
+	}
+
+	for (; version < latestVersion; ++version)
+	{
+		LogInfo("Upgrading database schema to version %d (%s)", version + 1, migrations[version].description);
+
+		// Each migration is applied in its own transaction along with the version bump, so an interrupted upgrade resumes where it left off.
+		// Statements aren't prepared yet at this point, hence no DatabaseTransaction.
+		MUST_SUCCEED(sqlite3_exec(this->dbHandle, "BEGIN TRANSACTION", nullptr, nullptr, nullptr));
+		try
+		{
+			(this->*migrations[version].apply)();
+			this->SetSchemaVersion(version + 1);
+			MUST_SUCCEED(sqlite3_exec(this->dbHandle, "COMMIT", nullptr, nullptr, nullptr));
+		}
+		catch (const std::exception& e)
+		{
+			sqlite3_exec(this->dbHandle, "ROLLBACK", nullptr, nullptr, nullptr);
+			ThrowHelper("Database migration to version " + std::to_string(version + 1) + " failed: " + e.what());
+		}
+	}
+}
+
+void DatabaseInterface::MigrateToIntegerTimestamps()
+{
+	// Databases created before schema versioning was introduced already have all tables, with timestamps stored as text.
+	// SQLite cannot change the type of a column, so both affected tables are rebuilt. Old values are "YYYY-MM-DD HH:MM:SS" strings in UTC.
+	if (this->TableExists("users"))
+	{
+		LogInfo("Converting timestamps to integers, this may take a while");
+
+		MUST_SUCCEED(sqlite3_exec(this->dbHandle,
+			"CREATE TABLE users_new(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, lastSeen INTEGER NOT NULL DEFAULT 0);"
+			"INSERT INTO users_new (id, name, lastSeen) SELECT id, name, CAST(STRFTIME('%s', lastSeen) AS INTEGER) * 1000000 FROM users;"
+			"DROP TABLE users;"
+			"ALTER TABLE users_new RENAME TO users;"
+			"CREATE TABLE messages_new(id INTEGER PRIMARY KEY AUTOINCREMENT, chatId INTEGER NOT NULL, senderId INTEGER NOT NULL, content TEXT NOT NULL,"
+			"filePromiseId INTEGER DEFAULT NULL, sentTime INTEGER NOT NULL);"
+			"INSERT INTO messages_new (id, chatId, senderId, content, filePromiseId, sentTime) "
+			"SELECT id, chatId, senderId, content, filePromiseId, CAST(STRFTIME('%s', sentTime) AS INTEGER) * 1000000 FROM messages;"
+			"DROP TABLE messages;"
+			"ALTER TABLE messages_new RENAME TO messages;", nullptr, nullptr, nullptr));
+	}
+
+	// Timestamps (users.lastSeen, messages.sentTime) are stored as microseconds since the Unix epoch
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE TABLE IF NOT EXISTS users(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, lastSeen INTEGER NOT NULL DEFAULT 0)",
 		nullptr, nullptr, nullptr));
 	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE TABLE IF NOT EXISTS chats(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL DEFAULT \"unnamed chat\", isGroupChat INTEGER NOT NULL,"
 		"ownerUserId INTEGER NOT NULL)", nullptr, nullptr, nullptr));
 	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE TABLE IF NOT EXISTS users_in_chats(chatId INTEGER NOT NULL, userId INTEGER NOT NULL, hasRead INTEGER NOT NULL DEFAULT 0,"
 		"PRIMARY KEY(chatId, userId))", nullptr, nullptr, nullptr));
 	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY AUTOINCREMENT, chatId INTEGER NOT NULL, senderId INTEGER NOT NULL, content TEXT NOT NULL,"
-		"filePromiseId INTEGER DEFAULT NULL, sentTime TEXT NOT NULL DEFAULT CURRENT_TIMESTAMP)", nullptr, nullptr, nullptr));
+		"filePromiseId INTEGER DEFAULT NULL, sentTime INTEGER NOT NULL)", nullptr, nullptr, nullptr));
 }
 
-DatabaseInterface::~DatabaseInterface()
+void DatabaseInterface::MigrateToSecondaryIndexes()
 {
-	sqlite3_close(this->dbHandle);
+	// Some of these were created unversioned by earlier builds, hence IF NOT EXISTS.
+	// Usernames are looked up on every login and must not repeat; CreateLoginSession() only creates a user after a failed lookup,
+	// so existing databases are not expected to contain duplicates (if they do, the upgrade fails and names have to be fixed by hand).
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE UNIQUE INDEX IF NOT EXISTS users_by_name ON users(name)", nullptr, nullptr, nullptr));
+	// Chat history is paginated by message ID within a chat
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE INDEX IF NOT EXISTS messages_by_chat ON messages(chatId, id)", nullptr, nullptr, nullptr));
+	// Covering indexes for participant lists (by chat) and chat lists (by user), read state included
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE INDEX IF NOT EXISTS users_in_chats_by_chat ON users_in_chats(chatId, userId, hasRead)", nullptr, nullptr, nullptr));
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "CREATE INDEX IF NOT EXISTS users_in_chats_by_user ON users_in_chats(userId, chatId, hasRead)", nullptr, nullptr, nullptr));
 }
 
-bool DatabaseInterface::GetUserById(uint64_t userId, DatabaseUserInfo* userInfo)
+void DatabaseInterface::MigrateToReadWatermarks()
 {
-	sqlite3_stmt* stmt;
+	// Instead of a read flag for every participant (all of which had to be cleared by every message), chats store the ID of their latest message
+	// and participants the ID of the latest message they've read. Unread flags are converted to "everything but the latest message has been read".
+	MUST_SUCCEED(sqlite3_exec(this->dbHandle,
+		"ALTER TABLE chats ADD COLUMN lastMessageId INTEGER NOT NULL DEFAULT 0;"
+		"UPDATE chats SET lastMessageId = COALESCE((SELECT MAX(id) FROM messages WHERE messages.chatId = chats.id), 0);"
+		"ALTER TABLE users_in_chats ADD COLUMN lastReadMessageId INTEGER NOT NULL DEFAULT 0;"
+		"UPDATE users_in_chats SET lastReadMessageId = CASE WHEN hasRead != 0 "
+		"THEN (SELECT lastMessageId FROM chats WHERE chats.id = users_in_chats.chatId) "
+		"ELSE COALESCE((SELECT MAX(messages.id) FROM messages INNER JOIN chats ON messages.chatId = chats.id "
+		"WHERE messages.chatId = users_in_chats.chatId AND messages.id < chats.lastMessageId), 0) END;"
+		"DROP INDEX IF EXISTS users_in_chats_by_chat;"
+		"DROP INDEX IF EXISTS users_in_chats_by_user;"
+		"ALTER TABLE users_in_chats DROP COLUMN hasRead;"
+		"CREATE INDEX users_in_chats_by_chat ON users_in_chats(chatId, userId, lastReadMessageId);"
+		"CREATE INDEX users_in_chats_by_user ON users_in_chats(userId, chatId, lastReadMessageId);", nullptr, nullptr, nullptr));
+}
+
+void DatabaseInterface::PrepareStatements()
+{
+	memset(this->statements, 0, sizeof(this->statements));
+
+	// Statements prepared with sqlite3_prepare_v2() are recompiled by SQLite automatically if the schema changes later on
+	for (size_t i = 0; i < (size_t)DatabaseStatement::Count; ++i)
+	{
+		MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, StatementSQL[i], -1, &this->statements[i], nullptr));
+	}
+}
+
+void DatabaseInterface::ExecuteStatement(DatabaseStatement statement)
+{
+	ScopedStatement stmt(this->GetStatement(statement));
+	MUST_COMPLETE(stmt);
+}
+
+void DatabaseInterface::BeginTransaction()
+{
+	if (this->transactionDepth++ == 0)
+	{
+		this->ExecuteStatement(DatabaseStatement::BeginTransaction);
+	}
+}
+
+void DatabaseInterface::CommitTransaction()
+{
+	// If COMMIT fails, the depth stays as it was and the destructor of DatabaseTransaction rolls the transaction back
+	if (this->transactionDepth == 1)
+	{
+		this->ExecuteStatement(DatabaseStatement::CommitTransaction);
+	}
+
+	--this->transactionDepth;
+}
 
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT name, lastSeen FROM users WHERE id = ?", -1, &stmt, nullptr));
+void DatabaseInterface::RollbackTransaction()
+{
+	// Called from a destructor, so it must not throw. A nested transaction only unwinds; the outermost one performs the rollback.
+	if (--this->transactionDepth == 0)
+	{
+		ScopedStatement stmt(this->GetStatement(DatabaseStatement::RollbackTransaction));
+		if (sqlite3_step(stmt) != SQLITE_DONE)
+		{
+			LogError("Transaction rollback failed: %s", sqlite3_errmsg(this->dbHandle));
+		}
+	}
+}
+
+bool DatabaseInterface::GetUserById(uint64_t userId, DatabaseUserInfo* userInfo)
+{
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetUserById));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, userId));
 
 	if (sqlite3_step(stmt) == SQLITE_ROW)
@@ -47,19 +348,15 @@ bool DatabaseInterface::GetUserById(uint64_t userId, DatabaseUserInfo* userInfo)
 		userInfo->username = (char*)sqlite3_column_text(stmt, 0);
 		userInfo->lastSeen = sqlite3_column_int64(stmt, 1);
 
-		MUST_SUCCEED(sqlite3_finalize(stmt));
 		return true;
 	}
 
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 	return false;
 }
 
 bool DatabaseInterface::GetUserByName(const std::string& username, DatabaseUserInfo* userInfo)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT id, lastSeen FROM users WHERE name = ?", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetUserByName));
 	MUST_SUCCEED(sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC));
 
 	if (sqlite3_step(stmt) == SQLITE_ROW)
@@ -68,136 +365,138 @@ bool DatabaseInterface::GetUserByName(const std::string& username, DatabaseUserI
 		userInfo->lastSeen = sqlite3_column_int64(stmt, 1);
 		userInfo->username = username;
 
-		MUST_SUCCEED(sqlite3_finalize(stmt));
 		return true;
 	}
 
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 	return false;
 }
 
 void DatabaseInterface::CreateUser(const std::string& username)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "INSERT INTO users (name) VALUES (?)", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::CreateUser));
 	MUST_SUCCEED(sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, GetCurrentTimestamp()));
+	MUST_COMPLETE(stmt);
 
 	LogInfo("New user created: %s", username.c_str());
 }
 
-void DatabaseInterface::UpdateLastSeenTime(uint64_t userId)
+void DatabaseInterface::UpdateLastSeenTimes(const std::vector<uint64_t>& userIds)
 {
-	sqlite3_stmt* stmt;
+	DatabaseTransaction transaction(this);
+	uint64_t timestamp = GetCurrentTimestamp();
 
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "UPDATE users SET lastSeen = CURRENT_TIMESTAMP WHERE id = ?", -1, &stmt, nullptr));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, userId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	for (uint64_t userId : userIds)
+	{
+		ScopedStatement stmt(this->GetStatement(DatabaseStatement::UpdateLastSeenTime));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, timestamp));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, userId));
+		MUST_COMPLETE(stmt);
+	}
+
+	transaction.Commit();
 }
 
 void DatabaseInterface::GetChatsForUser(uint64_t userId, DatabaseChatRoomList* chatList)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT chatId FROM users_in_chats WHERE userId = ? ORDER BY chatId DESC", -1, &stmt, nullptr));
+	// The name and the read flag come from the same row, so the whole list is fetched with a single statement
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetChatsForUser));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, userId));
 
 	while (sqlite3_step(stmt) == SQLITE_ROW)
 	{
 		DatabaseChatRoomInfoLite roomInfo;
 		roomInfo.chatId = sqlite3_column_int64(stmt, 0);
-
-		DatabaseChatRoomInfo fullRoomInfo;
-		this->GetChatById(roomInfo.chatId, &fullRoomInfo);
-
-		roomInfo.chatName = fullRoomInfo.chatName;
-		roomInfo.isUnread = !IsChatReadByUser(roomInfo.chatId, userId);
+		roomInfo.chatName = (char*)sqlite3_column_text(stmt, 1);
+		roomInfo.isUnread = sqlite3_column_int(stmt, 2) != 0;
 
 		chatList->chats.push_back(roomInfo);
 	}
-
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 }
 
 uint64_t DatabaseInterface::CreateChat(uint64_t ownerUserId, const std::vector<uint64_t>& participants, bool isGroupChat)
 {
-	sqlite3_stmt* stmt;
+	DatabaseTransaction transaction(this);
 
-	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "BEGIN TRANSACTION", nullptr, nullptr, nullptr));
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "INSERT INTO chats (isGroupChat, ownerUserId) VALUES (?, ?)", -1, &stmt, nullptr));
-	MUST_SUCCEED(sqlite3_bind_int(stmt, 1, isGroupChat ? 1 : 0));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, ownerUserId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	{
+		ScopedStatement stmt(this->GetStatement(DatabaseStatement::CreateChat));
+		MUST_SUCCEED(sqlite3_bind_int(stmt, 1, isGroupChat ? 1 : 0));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, ownerUserId));
+		MUST_COMPLETE(stmt);
+	}
 
 	uint64_t chatId = sqlite3_last_insert_rowid(this->dbHandle);
 
-	for (uint64_t userId : participants)
+	for (size_t batchStart = 0; batchStart < participants.size(); batchStart += ParticipantBatchSize)
 	{
-		this->AddChatParticipant(chatId, userId);
+		size_t batchSize = std::min(ParticipantBatchSize, participants.size() - batchStart);
+
+		ScopedStatement stmt(this->GetStatement(DatabaseStatement::AddChatParticipants));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
+
+		// Unused parameters of the last batch repeat its last user, which doesn't change the result of IN
+		for (size_t i = 0; i < ParticipantBatchSize; ++i)
+		{
+			MUST_SUCCEED(sqlite3_bind_int64(stmt, (int)i + 2, participants[batchStart + std::min(i, batchSize - 1)]));
+		}
+
+		MUST_COMPLETE(stmt);
+
+		// Some of the users don't exist; the transaction is rolled back
+		if ((size_t)sqlite3_changes(this->dbHandle) != batchSize)
+		{
+			return INVALID_CHAT_ID;
+		}
 	}
 
 	this->AddChatMessage(chatId, INVALID_USER_ID, "Chatroom created", nullptr);
 
-	MUST_SUCCEED(sqlite3_exec(this->dbHandle, "COMMIT", nullptr, nullptr, nullptr));
+	transaction.Commit();
 
 	return chatId;
 }
 
 void DatabaseInterface::AddChatParticipant(uint64_t chatId, uint64_t userId)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "INSERT INTO users_in_chats (chatId, userId) VALUES (?, ?)", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::AddChatParticipant));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, userId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	MUST_COMPLETE(stmt);
 }
 
 bool DatabaseInterface::GetChatById(uint64_t chatId, DatabaseChatRoomInfo* chatInfo)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT name, isGroupChat, ownerUserId FROM chats WHERE id = ?", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetChatById));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
 
 	if (sqlite3_step(stmt) == SQLITE_ROW)
 	{
 		chatInfo->allParticipants.clear();
+		chatInfo->participantsLastRead.clear();
 		chatInfo->chatRoomId = chatId;
 		chatInfo->chatName = (char*)sqlite3_column_text(stmt, 0);
 		chatInfo->isGroupChat = sqlite3_column_int(stmt, 1) != 0;
 		chatInfo->ownerUserId = sqlite3_column_int64(stmt, 2);
+		chatInfo->lastMessageId = sqlite3_column_int64(stmt, 3);
 
-		MUST_SUCCEED(sqlite3_finalize(stmt));
-
-		MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT userId FROM users_in_chats WHERE chatId = ?", -1, &stmt, nullptr));
-		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
+		ScopedStatement participantsStmt(this->GetStatement(DatabaseStatement::GetChatParticipants));
+		MUST_SUCCEED(sqlite3_bind_int64(participantsStmt, 1, chatId));
 
-		while (sqlite3_step(stmt) == SQLITE_ROW)
+		while (sqlite3_step(participantsStmt) == SQLITE_ROW)
 		{
-			chatInfo->allParticipants.push_back(sqlite3_column_int64(stmt, 0));
+			chatInfo->allParticipants.push_back(sqlite3_column_int64(participantsStmt, 0));
+			chatInfo->participantsLastRead.push_back(sqlite3_column_int64(participantsStmt, 1));
 		}
 
-		MUST_SUCCEED(sqlite3_finalize(stmt));
 		return true;
 	}
 
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 	return false;
 }
 
 void DatabaseInterface::GetUsersInChat(uint64_t chatId, DatabaseUserInfoList* userList)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT userId, STRFTIME('%s', lastSeen) FROM users_in_chats INNER JOIN users ON userId = users.id "
-		"WHERE chatId = ? ORDER BY name ASC", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetUsersInChat));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
 
 	while (sqlite3_step(stmt) == SQLITE_ROW)
@@ -205,55 +504,62 @@ void DatabaseInterface::GetUsersInChat(uint64_t chatId, DatabaseUserInfoList* us
 		DatabaseUserInfoLite userInfo;
 		userInfo.userId = sqlite3_column_int64(stmt, 0);
 		userInfo.lastSeen = sqlite3_column_int64(stmt, 1);
-		userInfo.hasReadChat = IsChatReadByUser(chatId, userInfo.userId);
+		userInfo.hasReadChat = sqlite3_column_int(stmt, 2) != 0;
 
 		userList->users.push_back(userInfo);
 	}
-
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 }
 
 void DatabaseInterface::RenameChat(uint64_t chatId, const std::string& newName)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "UPDATE chats SET name = ? WHERE id = ?", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::RenameChat));
 	MUST_SUCCEED(sqlite3_bind_text(stmt, 1, newName.c_str(), -1, SQLITE_STATIC));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, chatId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	MUST_COMPLETE(stmt);
 }
 
-bool DatabaseInterface::GetChatMessages(uint64_t chatId, DatabaseChatMessages* chatMessages)
+bool DatabaseInterface::GetChatMessages(uint64_t chatId, uint64_t beforeMessageId, size_t maxCount, DatabaseChatMessages* chatMessages)
 {
-	sqlite3_stmt* stmt;
-
 	chatMessages->messages.clear();
+	chatMessages->historyCursor = 0;
 
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT senderId, content, STRFTIME('%s', sentTime), filePromiseId FROM messages WHERE chatId = ? ORDER BY sentTime ASC", -1, &stmt, nullptr));
+	// Messages are fetched newest first, one more than requested - that extra row only tells us whether an older page exists
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::GetChatMessages));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
+	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, beforeMessageId != 0 ? beforeMessageId : INT64_MAX));
+	MUST_SUCCEED(sqlite3_bind_int64(stmt, 3, maxCount + 1));
 
+	uint64_t oldestMessageId = 0;
 	while (sqlite3_step(stmt) == SQLITE_ROW)
 	{
+		if (chatMessages->messages.size() == maxCount)
+		{
+			chatMessages->historyCursor = oldestMessageId;
+			break;
+		}
+
+		oldestMessageId = sqlite3_column_int64(stmt, 0);
+
 		ChatMessage msg;
-		msg.author = sqlite3_column_int64(stmt, 0);
-		msg.message = (char*)sqlite3_column_text(stmt, 1);
-		msg.sentTimestamp = sqlite3_column_int64(stmt, 2);
-		msg.filePromiseId = sqlite3_column_int64(stmt, 3);
+		msg.author = sqlite3_column_int64(stmt, 1);
+		msg.message = (char*)sqlite3_column_text(stmt, 2);
+		msg.sentTimestamp = sqlite3_column_int64(stmt, 3);
+		msg.filePromiseId = sqlite3_column_int64(stmt, 4);
 
 		chatMessages->messages.push_back(msg);
 	}
 
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	std::reverse(chatMessages->messages.begin(), chatMessages->messages.end());
 	return true;
 }
 
-void DatabaseInterface::AddChatMessage(uint64_t chatId, uint64_t senderId, const std::string& message, uint64_t* msgTimestamp, uint64_t filePromiseId)
+uint64_t DatabaseInterface::AddChatMessage(uint64_t chatId, uint64_t senderId, const std::string& message, uint64_t* msgTimestamp, uint64_t filePromiseId)
 {
-	sqlite3_stmt* stmt;
+	// The message and the chat's latest message ID are written together, with a single commit
+	DatabaseTransaction transaction(this);
 
 	// Add the message.
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "INSERT INTO messages (chatId, senderId, content, filePromiseId) VALUES (?, ?, ?, ?)", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::AddChatMessage));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, senderId));
 	MUST_SUCCEED(sqlite3_bind_text(stmt, 3, message.c_str(), -1, SQLITE_STATIC));
@@ -267,82 +573,81 @@ void DatabaseInterface::AddChatMessage(uint64_t chatId, uint64_t senderId, const
 		MUST_SUCCEED(sqlite3_bind_null(stmt, 4));
 	}
 
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	uint64_t sentTime = GetCurrentTimestamp();
+	MUST_SUCCEED(sqlite3_bind_int64(stmt, 5, sentTime));
+
+	MUST_COMPLETE(stmt);
+
+	uint64_t messageId = sqlite3_last_insert_rowid(this->dbHandle);
 
-	// Update read receipts (if the message is not a system message, that is) for everybody other than the message reader
-	if (senderId != INVALID_USER_ID)
+	// Everybody whose read watermark is below this message has an unread chat now - only the chat row is written, however many participants there are
 	{
-		MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "UPDATE users_in_chats SET hasRead = 0 WHERE chatId = ? AND userId != ?", -1, &stmt, nullptr));
-		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
-		MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, senderId));
-		sqlite3_step(stmt);
-		MUST_SUCCEED(sqlite3_finalize(stmt));
+		ScopedStatement chatStmt(this->GetStatement(DatabaseStatement::SetChatLastMessage));
+		MUST_SUCCEED(sqlite3_bind_int64(chatStmt, 1, messageId));
+		MUST_SUCCEED(sqlite3_bind_int64(chatStmt, 2, chatId));
+		MUST_COMPLETE(chatStmt);
 	}
 
-	// Fetch the timestamp of the newly added message (if applicable)
+	transaction.Commit();
+
+	// The timestamp is computed here, so there's no need to read it back
 	if (msgTimestamp)
 	{
-		MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT STRFTIME('%s', sentTime) FROM messages WHERE id = ?", -1, &stmt, nullptr));
-		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, sqlite3_last_insert_rowid(this->dbHandle)));
-		if (sqlite3_step(stmt) == SQLITE_ROW)
-		{
-			*msgTimestamp = sqlite3_column_int64(stmt, 0);
-		}
-		MUST_SUCCEED(sqlite3_finalize(stmt));
+		*msgTimestamp = sentTime;
 	}
+
+	return messageId;
 }
 
-void DatabaseInterface::AddFilePromiseMessage(uint64_t chatId, uint64_t senderId, uint64_t promiseId, const std::string& fileName, uint64_t* msgTimestamp)
+void DatabaseInterface::AddChatMessages(std::vector<PendingChatMessage>& messages)
 {
-	this->AddChatMessage(chatId, senderId, fileName, msgTimestamp, promiseId);
+	DatabaseTransaction transaction(this);
+
+	for (PendingChatMessage& pending : messages)
+	{
+		pending.messageId = this->AddChatMessage(pending.chatId, pending.senderId, pending.message, &pending.sentTimestamp, pending.filePromiseId);
+	}
+
+	transaction.Commit();
 }
 
-bool DatabaseInterface::IsChatReadByUser(uint64_t chatId, uint64_t userId)
+void DatabaseInterface::Checkpoint()
 {
-	sqlite3_stmt* stmt;
-	bool retval = false;
+	int logFrames = 0;
+	int checkpointedFrames = 0;
 
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "SELECT hasRead FROM users_in_chats WHERE chatId = ? AND userId = ?", -1, &stmt, nullptr));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, userId));
-	if (sqlite3_step(stmt) == SQLITE_ROW)
+	if (sqlite3_wal_checkpoint_v2(this->dbHandle, nullptr, SQLITE_CHECKPOINT_PASSIVE, &logFrames, &checkpointedFrames) != SQLITE_OK)
 	{
-		if (sqlite3_column_int64(stmt, 0) != 0)
-		{
-			retval = true;
-		}
+		LogWarning("Checkpoint failed: %s", sqlite3_errmsg(this->dbHandle));
+		return;
 	}
-	MUST_SUCCEED(sqlite3_finalize(stmt));
 
-	return retval;
+	if (logFrames != checkpointedFrames)
+	{
+		LogInfo("Checkpoint copied %d of %d frames, the rest is still in use", checkpointedFrames, logFrames);
+	}
 }
 
-bool DatabaseInterface::SetChatReadByUser(uint64_t chatId, uint64_t userId)
+void DatabaseInterface::SetChatsRead(const std::vector<ChatReadMark>& readMarks)
 {
-	sqlite3_stmt* stmt;
+	DatabaseTransaction transaction(this);
 
-	if (this->IsChatReadByUser(chatId, userId))
+	for (const ChatReadMark& readMark : readMarks)
 	{
-		return false;
+		ScopedStatement stmt(this->GetStatement(DatabaseStatement::AdvanceReadWatermark));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, readMark.lastReadMessageId));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, readMark.chatId));
+		MUST_SUCCEED(sqlite3_bind_int64(stmt, 3, readMark.userId));
+		MUST_COMPLETE(stmt);
 	}
 
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "UPDATE users_in_chats SET hasRead = 1 WHERE chatId = ? AND userId = ?", -1, &stmt, nullptr));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
-	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, userId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
-
-	return true;
+	transaction.Commit();
 }
 
 void DatabaseInterface::RemoveUserFromChat(uint64_t chatId, uint64_t userId)
 {
-	sqlite3_stmt* stmt;
-
-	MUST_SUCCEED(sqlite3_prepare_v2(this->dbHandle, "DELETE FROM users_in_chats WHERE chatId = ? AND userId = ?", -1, &stmt, nullptr));
+	ScopedStatement stmt(this->GetStatement(DatabaseStatement::RemoveUserFromChat));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 1, chatId));
 	MUST_SUCCEED(sqlite3_bind_int64(stmt, 2, userId));
-	sqlite3_step(stmt);
-	MUST_SUCCEED(sqlite3_finalize(stmt));
+	MUST_COMPLETE(stmt);
 }
@@ -6,6 +6,25 @@
 #include <string>
 #include <vector>
 
+// Settings applied to every database connection
+struct DatabaseSettings {
+	std::string path = "E:\\chatserver.db";
+
+	// PRAGMA synchronous; in WAL mode, NORMAL skips the fsync on commit and may lose the most recent commits on power loss (but never corrupts the database)
+	std::string synchronous = "FULL";
+
+	// Page cache size per connection, in KiB
+	int64_t cacheSizeKb = 64 * 1024;
+
+	// How much of the database file is memory-mapped, in bytes (0 disables memory-mapped I/O)
+	int64_t mmapSizeBytes = 256 * 1024 * 1024;
+
+	// Keep temporary tables and indexes (e.g. for sorting) in memory rather than in temporary files
+	bool tempStoreInMemory = true;
+};
+
+// All timestamps are expressed in microseconds since the Unix epoch
+
 struct DatabaseUserInfo {
 	uint64_t userId;
 	uint64_t lastSeen;
@@ -25,7 +44,9 @@ struct DatabaseUserInfoList {
 struct DatabaseChatRoomInfo {
 	uint64_t chatRoomId;
 	uint64_t ownerUserId;
-	std::vector<uint64_t> allParticipants;
+	std::vector<uint64_t> allParticipants; // sorted by user ID
+	std::vector<uint64_t> participantsLastRead; // ID of the latest message read by each participant, in the same order
+	uint64_t lastMessageId; // the chat is unread by participants who haven't read this message yet
 	std::string chatName;
 	bool isGroupChat;
 };
@@ -49,22 +70,92 @@ struct ChatMessage {
 
 struct DatabaseChatMessages {
 	std::vector<ChatMessage> messages;
+	uint64_t historyCursor; // ID of the oldest fetched message if older ones exist, 0 otherwise
+};
+
+// A chat message waiting to be written by DatabaseInterface::AddChatMessages()
+struct PendingChatMessage {
+	uint64_t chatId;
+	uint64_t senderId;
+	uint64_t filePromiseId;
+	std::string message;
+	uint64_t sentTimestamp; // filled in when the message is written
+	uint64_t messageId; // filled in when the message is written
+};
+
+// A participant who has read a chat up to a message, written by DatabaseInterface::SetChatsRead()
+struct ChatReadMark {
+	uint64_t chatId;
+	uint64_t userId;
+	uint64_t lastReadMessageId;
+};
+
+// Every SQL statement used by DatabaseInterface. They are prepared once, when the database is opened, and reused afterwards.
+enum class DatabaseStatement : size_t {
+	BeginTransaction,
+	CommitTransaction,
+	RollbackTransaction,
+	GetUserById,
+	GetUserByName,
+	CreateUser,
+	UpdateLastSeenTime,
+	GetChatsForUser,
+	CreateChat,
+	AddChatParticipant,
+	AddChatParticipants,
+	GetChatById,
+	GetChatParticipants,
+	GetUsersInChat,
+	RenameChat,
+	GetChatMessages,
+	AddChatMessage,
+	SetChatLastMessage,
+	AdvanceReadWatermark,
+	RemoveUserFromChat,
+
+	Count
 };
 
 class DatabaseInterface {
 private:
+	friend class DatabaseTransaction;
+
 	sqlite3* dbHandle;
+	sqlite3_stmt* statements[(size_t)DatabaseStatement::Count];
+
+	// Number of DatabaseTransaction objects currently alive; only the outermost one begins and ends the SQLite transaction
+	int transactionDepth;
+
+	int GetSchemaVersion();
+	void SetSchemaVersion(int version);
+	bool TableExists(const char* tableName);
+
+	// Brings the schema up to date, one versioned migration at a time
+	void ApplyMigrations();
+	void MigrateToIntegerTimestamps();
+	void MigrateToSecondaryIndexes();
+	void MigrateToReadWatermarks();
+
+	void ApplySettings(const DatabaseSettings& settings);
+	void PrepareStatements();
+	void ExecuteStatement(DatabaseStatement statement);
+	void BeginTransaction();
+	void CommitTransaction();
+	void RollbackTransaction();
+	inline sqlite3_stmt* GetStatement(DatabaseStatement statement) { return statements[(size_t)statement]; }
 
 public:
-	DatabaseInterface(const char* databasePath);
+	DatabaseInterface(const DatabaseSettings& settings);
 	~DatabaseInterface();
 
 	bool GetUserById(uint64_t userId, DatabaseUserInfo* userInfo);
 	bool GetUserByName(const std::string& username, DatabaseUserInfo* userInfo);
 	void CreateUser(const std::string& username);
-	void UpdateLastSeenTime(uint64_t userId);
+	// Sets the "last seen" time of all given users to the current time, in a single transaction
+	void UpdateLastSeenTimes(const std::vector<uint64_t>& userIds);
 	void GetChatsForUser(uint64_t userId, DatabaseChatRoomList* chatList);
 
+	// Participants must be unique. Returns INVALID_CHAT_ID (and creates nothing) if some of them don't exist.
 	uint64_t CreateChat(uint64_t ownerUserId, const std::vector<uint64_t>& participants, bool isGroupChat);
 	void AddChatParticipant(uint64_t chatId, uint64_t userId);
 	void RemoveUserFromChat(uint64_t chatId, uint64_t userId);
@@ -72,9 +163,15 @@ public:
 	void GetUsersInChat(uint64_t chatId, DatabaseUserInfoList* userList);
 	void RenameChat(uint64_t chatId, const std::string& newName);
 
-	bool GetChatMessages(uint64_t chatId, DatabaseChatMessages* chatMessages);
-	void AddChatMessage(uint64_t chatId, uint64_t senderId, const std::string& message, uint64_t* msgTimestamp, uint64_t filePromiseId = 0);
-	void AddFilePromiseMessage(uint64_t chatId, uint64_t senderId, uint64_t promiseId, const std::string& fileName, uint64_t* msgTimestamp);
-	bool IsChatReadByUser(uint64_t chatId, uint64_t userId);
-	bool SetChatReadByUser(uint64_t chatId, uint64_t userId);
+	// Fetches up to maxCount messages sent directly before beforeMessageId (0 to fetch the most recent ones), oldest first
+	bool GetChatMessages(uint64_t chatId, uint64_t beforeMessageId, size_t maxCount, DatabaseChatMessages* chatMessages);
+	// Returns the ID of the new message
+	uint64_t AddChatMessage(uint64_t chatId, uint64_t senderId, const std::string& message, uint64_t* msgTimestamp, uint64_t filePromiseId = 0);
+	// Writes all messages in a single transaction
+	void AddChatMessages(std::vector<PendingChatMessage>& messages);
+	// Copies committed pages from the write-ahead log into the database file, as far as that's possible without waiting for readers or writers
+	void Checkpoint();
+
+	// Moves the read watermarks of the users forward (never backwards), in a single transaction
+	void SetChatsRead(const std::vector<ChatReadMark>& readMarks);
 };
@@ -0,0 +1,155 @@
+#include "DatabaseWorker.h"
+#include "DatabaseInterface.h"
+#include "../Logger.h"
+
+#include <stdexcept>
+
+static void DeleteRequests(DatabaseRequest* request)
+{
+	while (request)
+	{
+		DatabaseRequest* next = request->next;
+		delete request;
+		request = next;
+	}
+}
+
+DatabaseWorker::DatabaseWorker(const DatabaseSettings& settings)
+{
+	this->dbConnection = std::make_unique<DatabaseInterface>(settings);
+	this->exitFlag = false;
+
+	// The wakeup socket is connected to itself, so the database thread can simply send() to it
+	this->wakeupSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (this->wakeupSocket == INVALID_SOCKET)
+	{
+		throw std::runtime_error("Cannot create the database wakeup socket");
+	}
+
+	sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0; // any free port
+
+	int addrLen = sizeof(addr);
+	if (bind(this->wakeupSocket, (sockaddr*)&addr, sizeof(addr)) != 0 || getsockname(this->wakeupSocket, (sockaddr*)&addr, &addrLen) != 0 ||
+		connect(this->wakeupSocket, (sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		closesocket(this->wakeupSocket);
+		throw std::runtime_error("Cannot set up the database wakeup socket");
+	}
+
+	u_long nonBlocking = 1;
+	if (ioctlsocket(this->wakeupSocket, FIONBIO, &nonBlocking) != 0)
+	{
+		LogWarning("ioctlsocket() failed [error %u]", WSAGetLastError());
+	}
+
+	this->hWorkEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+	this->hThread = CreateThread(nullptr, 0, WorkerThread, this, 0, nullptr);
+}
+
+DatabaseWorker::~DatabaseWorker()
+{
+	this->exitFlag = true;
+	SetEvent(this->hWorkEvent);
+
+	WaitForSingleObject(this->hThread, INFINITE);
+	CloseHandle(this->hThread);
+	CloseHandle(this->hWorkEvent);
+
+	// Requests that haven't run (or haven't been completed) by now are simply dropped
+	DeleteRequests(this->submittedRequests.PopAll());
+	DeleteRequests(this->completedRequests.PopAll());
+
+	closesocket(this->wakeupSocket);
+}
+
+DWORD CALLBACK DatabaseWorker::WorkerThread(LPVOID lpParameter)
+{
+	((DatabaseWorker*)lpParameter)->RunRequests();
+	return 0;
+}
+
+void DatabaseWorker::RunRequests()
+{
+	while (!this->exitFlag)
+	{
+		// The event is set whenever a request is pushed to an empty queue
+		WaitForSingleObject(this->hWorkEvent, INFINITE);
+
+		DatabaseRequest* request = this->submittedRequests.PopAll();
+		while (request)
+		{
+			DatabaseRequest* next = request->next;
+
+			try
+			{
+				request->work(this->dbConnection.get());
+				request->succeeded = true;
+			}
+			catch (const std::exception& ex)
+			{
+				LogError("Database request failed: %s", ex.what());
+				request->succeeded = false;
+			}
+
+			if (this->completedRequests.Push(request))
+			{
+				this->WakeNetworkThread();
+			}
+
+			request = next;
+		}
+	}
+}
+
+void DatabaseWorker::WakeNetworkThread()
+{
+	char wakeupByte = 0;
+	if (send(this->wakeupSocket, &wakeupByte, sizeof(wakeupByte), 0) == SOCKET_ERROR)
+	{
+		LogWarning("Cannot wake up the network thread [error %u]", WSAGetLastError());
+	}
+}
+
+void DatabaseWorker::Submit(std::function<void(DatabaseInterface*)> work, std::function<void(bool succeeded)> complete)
+{
+	DatabaseRequest* request = new DatabaseRequest();
+	request->work = std::move(work);
+	request->complete = std::move(complete);
+	request->succeeded = false;
+
+	if (this->submittedRequests.Push(request))
+	{
+		SetEvent(this->hWorkEvent);
+	}
+}
+
+void DatabaseWorker::RunCompletions()
+{
+	// Drain the wakeup datagrams first; a completion pushed after this point sends a new one
+	char buf[64];
+	while (recv(this->wakeupSocket, buf, sizeof(buf), 0) > 0)
+	{
+	}
+
+	DatabaseRequest* request = this->completedRequests.PopAll();
+	while (request)
+	{
+		DatabaseRequest* next = request->next;
+
+		try
+		{
+			request->complete(request->succeeded);
+		}
+		catch (const std::exception& ex)
+		{
+			LogError("Database request completion failed: %s", ex.what());
+		}
+
+		delete request;
+
+		request = next;
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <WinSock2.h>
+#include <Windows.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "MPSCQueue.h"
+
+class DatabaseInterface;
+struct DatabaseSettings;
+
+// A unit of work for the database thread. Work runs on the database thread (with the worker's own connection),
+// complete runs afterwards on the network thread, where it may touch clients and send packets.
+struct DatabaseRequest {
+	std::function<void(DatabaseInterface*)> work;
+	std::function<void(bool succeeded)> complete; // succeeded is false if work threw an exception
+	bool succeeded;
+
+	DatabaseRequest* next;
+};
+
+// Runs database requests on a dedicated thread, so that slow queries and commits don't stall the network loop.
+// Requests are executed one at a time, in the order they were submitted.
+class DatabaseWorker {
+private:
+	std::unique_ptr<DatabaseInterface> dbConnection;
+
+	HANDLE hThread;
+	HANDLE hWorkEvent;
+	std::atomic<bool> exitFlag;
+
+	MPSCQueue<DatabaseRequest> submittedRequests;
+	MPSCQueue<DatabaseRequest> completedRequests;
+
+	// Loopback UDP socket polled by the network loop; the database thread sends a datagram to it when requests complete
+	SOCKET wakeupSocket;
+
+	static DWORD CALLBACK WorkerThread(LPVOID lpParameter);
+	void RunRequests();
+	void WakeNetworkThread();
+
+public:
+	DatabaseWorker(const DatabaseSettings& settings);
+	~DatabaseWorker();
+
+	DatabaseWorker(const DatabaseWorker&) = delete;
+	DatabaseWorker& operator=(const DatabaseWorker&) = delete;
+
+	// Queues a request for the database thread; can be called from any thread
+	void Submit(std::function<void(DatabaseInterface*)> work, std::function<void(bool succeeded)> complete);
+
+	// Must be polled for readability by the network loop
+	inline SOCKET GetWakeupSocket() { return this->wakeupSocket; }
+
+	// Runs the completion handlers of finished requests; called by the network loop when the wakeup socket becomes readable
+	void RunCompletions();
+};
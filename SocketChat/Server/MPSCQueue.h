@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free queue with any number of producers and a single consumer. Items are linked through their own "next" member,
+// so pushing never allocates. The consumer always takes everything that has been queued so far, in the order it was pushed.
+template <typename T>
+class MPSCQueue {
+private:
+	std::atomic<T*> head;
+
+public:
+	MPSCQueue() : head(nullptr) {}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	// Returns true if the queue was empty, i.e. the consumer may need to be woken up
+	bool Push(T* item)
+	{
+		T* oldHead = this->head.load(std::memory_order_relaxed);
+		do
+		{
+			item->next = oldHead;
+		} while (!this->head.compare_exchange_weak(oldHead, item, std::memory_order_release, std::memory_order_relaxed));
+
+		return oldHead == nullptr;
+	}
+
+	// Takes all queued items and returns them as a list linked through "next", oldest first (nullptr if the queue is empty)
+	T* PopAll()
+	{
+		T* items = this->head.exchange(nullptr, std::memory_order_acquire);
+
+		// items were pushed to the front, so the list has to be reversed
+		T* oldestFirst = nullptr;
+		while (items)
+		{
+			T* next = items->next;
+			items->next = oldestFirst;
+			oldestFirst = items;
+			items = next;
+		}
+
+		return oldestFirst;
+	}
+};
@@ -1,5 +1,7 @@
 #include "RemoteClient.h"
 #include "ServerApplication.h"
+#include "DatabaseWorker.h"
+#include "ChatDirectory.h"
 
 #include "../Logger.h"
 #include "../Packets/NetPacket.h"
@@ -7,111 +9,134 @@
 
 #include <memory>
 
+// How much free space the receive buffer has before each recv() call
+constexpr size_t ReceiveChunkSize = 64 * 1024;
+
+// Every packet is preceded by its length (a 32-bit integer)
+constexpr size_t PacketLengthPrefixSize = sizeof(uint32_t);
+
 ClientProcessingResult RemoteClient::ReadData()
 {
-	// First, we read the initial 4 bytes (32-bit integer) of the packet, which represent the whole packet's length
-	if (this->currentPacketLengthPosIndex < 4)
+	// Move the unprocessed bytes (at most one incomplete packet) to the beginning of the buffer, then make sure that there's room for more
+	if (this->receiveReadPos > 0)
 	{
-		// Even these 4 bytes might come in several recv() calls, we must handle that.
-		int remainingPacketLengthBytes = 4 - this->currentPacketLengthPosIndex;
-		int retval = recv(this->s, (char*)this->currentPacketLengthBytes + this->currentPacketLengthPosIndex, remainingPacketLengthBytes, 0);
-		if (retval == 0)
-		{
-			return ClientProcessingResult::CloseConnection;
-		}
-		else if (retval == SOCKET_ERROR)
-		{
-			// If actual error occurred, terminate the connection
-			if (WSAGetLastError() != WSAEWOULDBLOCK)
-			{
-				LogWarning("Failed to read from %s [error %u]", this->ipAddress.c_str(), WSAGetLastError());
-				return ClientProcessingResult::TerminateConnection;
-			}
-			// if disconnection is scheduled, and there is no pending incoming packet, and everything has been sent, then we disconnect
-			else if (this->disconnectionInProgress && this->currentPacketLengthPosIndex == 0 && this->outgoingDataBuffer.empty())
-			{
-				shutdown(this->s, SD_BOTH);
-				return ClientProcessingResult::CloseConnection;
-			}
-		}
-		else if (retval > 0)
-		{
-			this->currentPacketLengthPosIndex += retval;
-		}
+		memmove(this->receiveBuffer.data(), this->receiveBuffer.data() + this->receiveReadPos, this->receiveWritePos - this->receiveReadPos);
+		this->receiveWritePos -= this->receiveReadPos;
+		this->receiveReadPos = 0;
+	}
 
-		// If we just received the full information about packet size, we must prepare for reading the actual packet
-		if (this->currentPacketLengthPosIndex == 4)
-		{
-			static_assert(sizeof(int) == 4, "sizeof(int) is not 4");
+	if (this->receiveBuffer.size() - this->receiveWritePos < ReceiveChunkSize)
+	{
+		this->receiveBuffer.resize(this->receiveWritePos + ReceiveChunkSize);
+	}
+
+	// Read as much as the socket has for us, we will split it into packets afterwards
+	int remainingBufferBytes = (int)(this->receiveBuffer.size() - this->receiveWritePos);
+	int retval = recv(this->s, (char*)this->receiveBuffer.data() + this->receiveWritePos, remainingBufferBytes, 0);
+	if (retval == 0)
+	{
+		return ClientProcessingResult::CloseConnection;
+	}
+	else if (retval == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+	{
+		// If actual error occurred, terminate the connection
+		LogWarning("Failed to read from %s [error %u]", this->ipAddress.c_str(), WSAGetLastError());
+		return ClientProcessingResult::TerminateConnection;
+	}
+	else if (retval > 0)
+	{
+		this->receiveWritePos += retval;
+	}
 
-			int packetLength = 0;
-			memcpy(&packetLength, this->currentPacketLengthBytes, 4);
+	return ClientProcessingResult::Continue;
+}
 
-			this->currentPacketPosIndex = 0;
-			this->currentPacketBytes.clear();
-			this->currentPacketBytes.resize(packetLength);
-		}
+size_t RemoteClient::GetBufferedPacketLength()
+{
+	size_t bufferedBytes = this->receiveWritePos - this->receiveReadPos;
+	if (bufferedBytes < PacketLengthPrefixSize)
+	{
+		return 0;
 	}
 
-	// Then, once we received the whole packet length, we read the packet
-	if (this->currentPacketLengthPosIndex == 4)
+	uint32_t packetLength = 0;
+	memcpy(&packetLength, this->receiveBuffer.data() + this->receiveReadPos, PacketLengthPrefixSize);
+
+	if (bufferedBytes - PacketLengthPrefixSize < packetLength)
 	{
-		int remainingPacketBytes = this->currentPacketBytes.size() - this->currentPacketPosIndex;
-		int retval = recv(this->s, (char*)this->currentPacketBytes.data() + this->currentPacketPosIndex, remainingPacketBytes, 0);
-		if (retval == 0)
+		return 0;
+	}
+
+	return PacketLengthPrefixSize + packetLength;
+}
+
+ClientProcessingResult RemoteClient::ProcessReceivedPackets()
+{
+	// Process every complete packet in the buffer, up to the configured budget
+	for (size_t processedPackets = 0; processedPackets < sApp->GetConfig().maxPacketsPerUpdate; ++processedPackets)
+	{
+		// A packet may have handed work to the database thread; the following packets have to wait for it to finish
+		if (this->IsWaitingForDatabase())
 		{
-			return ClientProcessingResult::CloseConnection;
+			break;
 		}
-		else if (retval == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+
+		size_t framedPacketLength = this->GetBufferedPacketLength();
+		if (framedPacketLength == 0)
 		{
-			LogWarning("Failed to read from %s [error %u]", this->ipAddress.c_str(), WSAGetLastError());
-			return ClientProcessingResult::TerminateConnection;
+			break;
 		}
-		else if (retval > 0)
+
+		uint8_t* packetData = this->receiveBuffer.data() + this->receiveReadPos + PacketLengthPrefixSize;
+		size_t packetLength = framedPacketLength - PacketLengthPrefixSize;
+
+		this->receiveReadPos += framedPacketLength;
+
+		// if disconnection is ongoing, don't accept any more data, instead we just wait for recv() to return 0
+		if (this->disconnectionInProgress)
 		{
-			this->currentPacketPosIndex += retval;
+			continue;
 		}
 
-		// If we received the entire packet, reset all progress variables (prepare for the next packet) and process the current one
-		if (this->currentPacketBytes.size() == (size_t)this->currentPacketPosIndex)
-		{
-			this->currentPacketLengthPosIndex = 0;
+		// The packet is read straight from the receive buffer, which stays untouched until the packet has been processed
+		NetPacket currentPacket = NetPacket::CreateView(packetData, packetLength);
 
-			// if disconnection is ongoing, don't accept any more data, instead we just wait for recv() to return 0
-			if (!this->disconnectionInProgress)
+		try
+		{
+			ClientProcessingResult packetResult = this->ProcessPacket(&currentPacket);
+			if (packetResult == ClientProcessingResult::CloseConnection)
+			{
+				// don't disconnect immediately, we'll wait for data to be sent first
+				this->disconnectionInProgress = true;
+			}
+			else if (packetResult != ClientProcessingResult::Continue)
 			{
-				std::unique_ptr<NetPacket> currentPacket = std::make_unique<NetPacket>(this->currentPacketBytes.data(), this->currentPacketBytes.size());
-
-				try
-				{
-					ClientProcessingResult packetResult = this->ProcessPacket(currentPacket.get());
-					if (packetResult == ClientProcessingResult::CloseConnection)
-					{
-						// don't disconnect immediately, we'll wait for data to be sent first
-						this->disconnectionInProgress = true;
-						return ClientProcessingResult::Continue;
-					}
-					else
-					{
-						return packetResult;
-					}
-				}
-				catch (const std::exception& ex)
-				{
-					LogError("Packet processing failed: %s", ex.what());
-					return ClientProcessingResult::TerminateConnection;
-				}
+				return packetResult;
 			}
 		}
+		catch (const std::exception& ex)
+		{
+			LogError("Packet processing failed: %s", ex.what());
+			return ClientProcessingResult::TerminateConnection;
+		}
+	}
+
+	// The whole buffer has been consumed, so the next recv() can start from the beginning
+	if (this->receiveReadPos == this->receiveWritePos)
+	{
+		this->receiveReadPos = 0;
+		this->receiveWritePos = 0;
 	}
 
-	// Otherwise, if we're still waiting for the packet, let the connection continue.
 	return ClientProcessingResult::Continue;
 }
 
+// Maximum number of frames handed to a single WSASend() call
+constexpr size_t MaxFramesPerSend = 64;
+
 ClientProcessingResult RemoteClient::SendPendingData()
 {
-	if (this->outgoingDataBuffer.empty())
+	if (this->outgoingFrames.empty())
 	{
 		if (this->disconnectionInProgress)
 		{
@@ -121,33 +146,82 @@ ClientProcessingResult RemoteClient::SendPendingData()
 		return ClientProcessingResult::Continue;
 	}
 
-	int remainingPacketBytes = this->outgoingDataBuffer.size() - this->outgoingDataPosIndex;
-	if (remainingPacketBytes > 0)
+	// Send the queued frames in batches, until everything is out or the socket's send buffer is full
+	while (!this->outgoingFrames.empty())
 	{
-		int retval = send(this->s, (const char*)this->outgoingDataBuffer.data() + this->outgoingDataPosIndex, remainingPacketBytes, 0);
-		if (retval == 0)
+		WSABUF buffers[MaxFramesPerSend];
+		DWORD bufferCount = 0;
+		size_t batchBytes = 0;
+
+		for (auto it = this->outgoingFrames.begin(); it != this->outgoingFrames.end() && bufferCount < MaxFramesPerSend; ++it)
 		{
-			return ClientProcessingResult::CloseConnection;
+			// only the first frame may have been partially sent already
+			size_t frameOffset = bufferCount == 0 ? this->outgoingFramePosIndex : 0;
+
+			buffers[bufferCount].buf = (CHAR*)it->frame->GetData() + frameOffset;
+			buffers[bufferCount].len = (ULONG)(it->frame->GetLength() - frameOffset);
+			batchBytes += buffers[bufferCount].len;
+			++bufferCount;
 		}
-		else if (retval == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+
+		DWORD sentBytes = 0;
+		if (WSASend(this->s, buffers, bufferCount, &sentBytes, 0, nullptr, nullptr) == SOCKET_ERROR)
 		{
-			LogWarning("Failed to send to %s [error %u]", this->ipAddress.c_str(), WSAGetLastError());
-			return ClientProcessingResult::TerminateConnection;
+			if (WSAGetLastError() != WSAEWOULDBLOCK)
+			{
+				LogWarning("Failed to send to %s [error %u]", this->ipAddress.c_str(), WSAGetLastError());
+				return ClientProcessingResult::TerminateConnection;
+			}
+
+			break;
 		}
-		else if (retval > 0)
+
+		this->ReleaseSentFrames(sentBytes);
+
+		// a partial send means that the socket cannot take any more data right now
+		if (sentBytes < batchBytes)
 		{
-			this->outgoingDataPosIndex += retval;
+			break;
 		}
+	}
+
+	return ClientProcessingResult::Continue;
+}
 
-		// we have successfully sent all data so far, so we clear the buffer
-		if (this->outgoingDataBuffer.size() == (size_t)this->outgoingDataPosIndex)
+void RemoteClient::ReleaseSentFrames(size_t sentBytes)
+{
+	this->queuedBytes -= sentBytes;
+
+	// frames that have been sent completely are released immediately, a partially sent one stays at the front
+	while (sentBytes > 0)
+	{
+		size_t remainingFrameBytes = this->outgoingFrames.front().frame->GetLength() - this->outgoingFramePosIndex;
+		if (sentBytes < remainingFrameBytes)
 		{
-			this->outgoingDataPosIndex = 0;
-			this->outgoingDataBuffer.clear();
+			this->outgoingFramePosIndex += sentBytes;
+			return;
 		}
+
+		sentBytes -= remainingFrameBytes;
+		this->outgoingFramePosIndex = 0;
+		this->outgoingFrames.pop_front();
 	}
+}
 
-	return ClientProcessingResult::Continue;
+void RemoteClient::RunDatabaseRequest(std::function<void(DatabaseInterface*)> work, std::function<void(RemoteClient* client, bool succeeded)> complete)
+{
+	this->BeginDatabaseRequest();
+
+	std::weak_ptr<RemoteClient> weakClient = this->weak_from_this();
+	sApp->GetDBWorker()->Submit(std::move(work), [weakClient, complete](bool succeeded)
+	{
+		std::shared_ptr<RemoteClient> client = weakClient.lock();
+		if (client)
+		{
+			client->EndDatabaseRequest();
+			complete(client.get(), succeeded);
+		}
+	});
 }
 
 void RemoteClient::SendChatList()
@@ -160,6 +234,16 @@ void RemoteClient::SendChatList()
 	DatabaseChatRoomList chatList;
 	sApp->GetDB()->GetChatsForUser(this->GetUserID(), &chatList);
 
+	// Read state in the database may still be waiting for the next flush; chats with unflushed read marks are always cached
+	for (DatabaseChatRoomInfoLite& room : chatList.chats)
+	{
+		const ChatDirectoryEntry* chat = sApp->GetChatDirectory()->FindCached(room.chatId);
+		if (chat)
+		{
+			room.isUnread = !chat->HasRead(this->GetUserID());
+		}
+	}
+
 	this->SetActiveChatID(INVALID_CHAT_ID);
 
 	PKT_S2C_ReplaceChatList pkt;
@@ -175,51 +259,111 @@ void RemoteClient::SendParticipantList()
 		return;
 	}
 
-	DatabaseUserInfoList userList;
-	sApp->GetDB()->GetUsersInChat(this->GetActiveChatID(), &userList);
+	// participant lists are refreshed periodically, so a slow client can skip some of them
+	this->SendFrame(sApp->CreateParticipantListFrame(this->GetActiveChatID()), true);
+}
+
+void RemoteClient::SendPacket(std::unique_ptr<NetPacket> pkt)
+{
+	if (disconnectionInProgress)
+	{
+		return;
+	}
+
+	this->SendFrame(NetFrame::Create(std::move(pkt)));
+}
 
-	for (size_t i = 0; i < userList.users.size(); ++i)
+void RemoteClient::SendFrame(const SharedNetFrame& frame, bool isDroppable)
+{
+	if (disconnectionInProgress || sendQueueOverflowed)
 	{
-		// Replace online users' "last seen time" with a special value that indicates that they're online
-		if (sApp->GetLoggedInClient(userList.users[i].userId))
+		return;
+	}
+
+	const ServerConfig& config = sApp->GetConfig();
+
+	// Droppable frames never count against the hard limit: a healthy client in the middle of a large file transfer can be far above
+	// the soft limit, and the participant list refresh that comes in the meantime is only coalesced or skipped, it doesn't disconnect it
+	if (isDroppable && this->queuedBytes > config.sendQueueSoftLimit)
+	{
+		if (this->CoalesceDroppableFrame(frame))
 		{
-			userList.users[i].lastSeen = CURRENTLY_ONLINE;
+			sApp->GetMetrics().slowConsumerFramesCoalesced++;
 		}
+		else
+		{
+			sApp->GetMetrics().slowConsumerFramesDropped++;
+		}
+
+		return;
 	}
 
-	PKT_S2C_ReplaceParticipantList pkt;
-	pkt.users = userList.users;
+	if (!isDroppable && this->queuedBytes + frame->GetLength() > config.sendQueueHardLimit)
+	{
+		// the client isn't reading what we send; it will be disconnected in the next pass of the event loop
+		this->sendQueueOverflowed = true;
+		sApp->GetMetrics().slowConsumerDisconnects++;
+		return;
+	}
 
-	this->SendPacket(pkt.Serialize());
+	this->outgoingFrames.push_back({ frame, isDroppable });
+	this->queuedBytes += frame->GetLength();
 }
 
-void RemoteClient::SendPacket(std::unique_ptr<NetPacket> pkt)
+bool RemoteClient::CoalesceDroppableFrame(const SharedNetFrame& frame)
 {
-	if (disconnectionInProgress)
+	// look for an older droppable frame that hasn't started being sent yet, and replace it with the new one
+	for (size_t i = this->outgoingFrames.size(); i > 0; --i)
 	{
-		return;
-	}
+		OutgoingFrame& queuedFrame = this->outgoingFrames[i - 1];
+		if (!queuedFrame.isDroppable || (i == 1 && this->outgoingFramePosIndex != 0))
+		{
+			continue;
+		}
 
-	uint32_t packetLength = pkt->GetLength();
+		this->queuedBytes -= queuedFrame.frame->GetLength();
+		this->queuedBytes += frame->GetLength();
+		queuedFrame.frame = frame;
 
-	uint8_t packetLengthBytes[sizeof(packetLength)];
-	memcpy(packetLengthBytes, &packetLength, sizeof(packetLength));
+		return true;
+	}
 
-	this->outgoingDataBuffer.insert(this->outgoingDataBuffer.end(), packetLengthBytes, packetLengthBytes + sizeof(packetLength));
-	this->outgoingDataBuffer.insert(this->outgoingDataBuffer.end(), pkt->GetData(), pkt->GetData() + pkt->GetLength());
+	return false;
 }
 
-ClientProcessingResult RemoteClient::Update()
+ClientProcessingResult RemoteClient::Update(bool isReadable, bool isWritable)
 {
-	ClientProcessingResult recvResult = this->ReadData();
-	if (recvResult == ClientProcessingResult::TerminateConnection)
+	ClientProcessingResult recvResult = ClientProcessingResult::Continue;
+
+	// Packets left over from the previous pass are processed before reading anything new
+	if (isReadable && !this->HasBufferedPackets())
 	{
-		return recvResult;
+		recvResult = this->ReadData();
+		if (recvResult == ClientProcessingResult::TerminateConnection)
+		{
+			return recvResult;
+		}
 	}
 
-	if (this->SendPendingData() == ClientProcessingResult::TerminateConnection)
+	ClientProcessingResult packetResult = this->ProcessReceivedPackets();
+	if (packetResult == ClientProcessingResult::TerminateConnection)
 	{
-		return ClientProcessingResult::TerminateConnection;
+		return packetResult;
+	}
+
+	if (isWritable)
+	{
+		if (this->SendPendingData() == ClientProcessingResult::TerminateConnection)
+		{
+			return ClientProcessingResult::TerminateConnection;
+		}
+	}
+
+	// if disconnection is scheduled, and there is no pending incoming packet, and everything has been sent, then we disconnect
+	if (recvResult == ClientProcessingResult::Continue && this->disconnectionInProgress && this->receiveReadPos == this->receiveWritePos && this->outgoingFrames.empty())
+	{
+		shutdown(this->s, SD_BOTH);
+		return ClientProcessingResult::CloseConnection;
 	}
 
 	return recvResult;
@@ -258,11 +402,14 @@ RemoteClient::RemoteClient(SOCKET s, sockaddr_in6* sockaddr_s)
 
 	this->userId = INVALID_USER_ID;
 	this->openChatId = INVALID_CHAT_ID;
+	this->pendingDatabaseRequests = 0;
 
-	this->currentPacketLengthPosIndex = 0;
-	this->currentPacketPosIndex = 0;
-	this->outgoingDataPosIndex = 0;
+	this->receiveReadPos = 0;
+	this->receiveWritePos = 0;
+	this->outgoingFramePosIndex = 0;
+	this->queuedBytes = 0;
 	this->disconnectionInProgress = false;
+	this->sendQueueOverflowed = false;
 
 	LogInfo("New incoming connection from %s", this->ipAddress.c_str());
 }
@@ -5,19 +5,27 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <memory>
+#include <functional>
+
+#include "../Packets/NetPacket.h"
 
-class NetPacket;
 class PKT_C2S_Login;
 class PKT_C2S_CreateChat;
 class PKT_C2S_ResolveUsername;
 class PKT_C2S_OpenChat;
+class PKT_C2S_RequestChatHistory;
 class PKT_C2S_SendMessage;
 class PKT_C2S_AddRemoveUser;
 class PKT_C2S_RenameChat;
 class PKT_C2S_FilePromise;
 class PKT_C2S_RequestFile;
 class PKT_C2S_SendFileChunk;
+class DatabaseInterface;
+struct DatabaseChatMessages;
+
+enum class LoginResult : uint8_t;
 
 enum class ClientProcessingResult {
 	Continue, // the connection will continue
@@ -25,7 +33,7 @@ enum class ClientProcessingResult {
 	TerminateConnection // the client misbehaves, so we send a RST flag and drop the connection
 };
 
-class RemoteClient {
+class RemoteClient : public std::enable_shared_from_this<RemoteClient> {
 private:
 	SOCKET s;
 	sockaddr_in6 sockaddr_s;
@@ -37,25 +45,45 @@ private:
 
 	uint64_t fileNextRecipient;
 
-	uint8_t currentPacketLengthBytes[4];
-	int currentPacketLengthPosIndex;
+	// Number of this client's requests that the database thread hasn't finished yet; no packets are processed until it drops to zero
+	size_t pendingDatabaseRequests;
+
+	// Incoming bytes land here; [receiveReadPos, receiveWritePos) are received bytes that haven't been processed yet
+	std::vector<uint8_t> receiveBuffer;
+	size_t receiveReadPos;
+	size_t receiveWritePos;
+
+	struct OutgoingFrame {
+		SharedNetFrame frame;
+		bool isDroppable; // the frame may be replaced by a newer one or skipped when the client is slow
+	};
 
-	std::vector<uint8_t> currentPacketBytes;
-	int currentPacketPosIndex;
+	// Frames waiting to be sent; the first one has already been sent up to outgoingFramePosIndex
+	std::deque<OutgoingFrame> outgoingFrames;
+	size_t outgoingFramePosIndex;
 
-	std::vector<uint8_t> outgoingDataBuffer;
-	int outgoingDataPosIndex;
+	// Number of bytes in outgoingFrames that haven't been sent yet
+	size_t queuedBytes;
 
 	bool disconnectionInProgress;
+	bool sendQueueOverflowed;
 
 	ClientProcessingResult ReadData();
+	ClientProcessingResult ProcessReceivedPackets();
+	size_t GetBufferedPacketLength();
 	ClientProcessingResult SendPendingData();
+	void ReleaseSentFrames(size_t sentBytes);
+	bool CoalesceDroppableFrame(const SharedNetFrame& frame);
 	ClientProcessingResult ProcessPacket(NetPacket* packet);
 
 	ClientProcessingResult ProcessPacket_Login(PKT_C2S_Login* packet);
+	void CompletePacket_Login(const std::string& username, LoginResult result);
 	ClientProcessingResult ProcessPacket_CreateChat(PKT_C2S_CreateChat* packet);
 	ClientProcessingResult ProcessPacket_ResolveUsername(PKT_C2S_ResolveUsername* packet);
 	ClientProcessingResult ProcessPacket_OpenChat(PKT_C2S_OpenChat* packet);
+	ClientProcessingResult ProcessPacket_RequestChatHistory(PKT_C2S_RequestChatHistory* packet);
+	void CompletePacket_OpenChat(uint64_t chatId, DatabaseChatMessages* chatMessages, bool succeeded);
+	void CompletePacket_RequestChatHistory(uint64_t chatId, uint64_t beforeMessageId, DatabaseChatMessages* chatMessages, bool succeeded);
 	ClientProcessingResult ProcessPacket_SendMessage(PKT_C2S_SendMessage* packet);
 	ClientProcessingResult ProcessPacket_AddRemoveUser(PKT_C2S_AddRemoveUser* packet);
 	ClientProcessingResult ProcessPacket_RenameChat(PKT_C2S_RenameChat* packet);
@@ -64,12 +92,40 @@ private:
 	ClientProcessingResult ProcessPacket_SendFileChunk(PKT_C2S_SendFileChunk* packet);
 
 public:
-	ClientProcessingResult Update();
+	// Handles the readiness reported by WSAPoll(): reads and processes incoming packets and/or sends pending data
+	ClientProcessingResult Update(bool isReadable, bool isWritable);
+
+	inline SOCKET GetSocket() { return this->s; }
+
+	// Returns true if at least one complete packet is waiting in the receive buffer
+	inline bool HasBufferedPackets() { return this->GetBufferedPacketLength() != 0; }
+
+	// Write interest is registered only while there's something to send
+	inline bool WantsToWrite() { return !this->outgoingFrames.empty(); }
+
+	// Returns how many bytes are waiting to be sent to this client
+	inline size_t GetQueuedBytes() { return this->queuedBytes; }
+
+	// Returns true if the client's send queue has reached the hard limit and the client must be disconnected
+	inline bool HasSendQueueOverflowed() { return this->sendQueueOverflowed; }
+
+	inline const std::string& GetIPAddress() { return this->ipAddress; }
 
 	inline bool IsLoggedIn() { return !this->username.empty(); }
 	inline std::string GetUsername() { return this->username; }
 	inline uint64_t GetUserID() { return this->userId; }
 	
+	// Returns true if the client is waiting for the database thread, and so its buffered packets can't be processed yet
+	inline bool IsWaitingForDatabase() { return this->pendingDatabaseRequests != 0; }
+
+	// Used for requests that are submitted on behalf of this client by someone else (e.g. message batches)
+	inline void BeginDatabaseRequest() { ++this->pendingDatabaseRequests; }
+	inline void EndDatabaseRequest() { --this->pendingDatabaseRequests; }
+
+	// Runs work on the database thread and then complete on the network thread, unless the client has been disconnected in the meantime.
+	// Packets received in the meantime are processed afterwards, so their order is preserved.
+	void RunDatabaseRequest(std::function<void(DatabaseInterface*)> work, std::function<void(RemoteClient* client, bool succeeded)> complete);
+
 	inline uint64_t GetActiveChatID() { return this->openChatId; }
 	inline void SetActiveChatID(uint64_t chatId) { this->openChatId = chatId; }
 
@@ -81,6 +137,10 @@ public:
 
 	void SendPacket(std::unique_ptr<NetPacket> pkt);
 
+	// Queues an already serialized frame; the frame is shared, not copied.
+	// Droppable frames are coalesced or skipped once the send queue is over the soft limit.
+	void SendFrame(const SharedNetFrame& frame, bool isDroppable = false);
+
 	void ShowMessageBox(const std::string& message, bool shouldDisconnect);
 	void ResetConnectionOnClose();
 
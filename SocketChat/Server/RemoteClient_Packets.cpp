@@ -1,6 +1,7 @@
 #include "RemoteClient.h"
 #include "ServerApplication.h"
 #include "DatabaseInterface.h"
+#include "ChatDirectory.h"
 
 #include "../Logger.h"
 #include "../Packets/NetPacket.h"
@@ -17,9 +18,38 @@ ClientProcessingResult RemoteClient::ProcessPacket_Login(PKT_C2S_Login* packet)
 	}
 
 	LoginResult result = sApp->CreateLoginSession(packet->username, &this->userId);
+	if (result == LoginResult::Failed)
+	{
+		// New users are created on the database thread, and the login is attempted again afterwards.
+		// Requests run in order there, so a concurrent login with the same username finds the user instead of creating it.
+		std::string username = packet->username;
+		this->RunDatabaseRequest([username](DatabaseInterface* db)
+		{
+			DatabaseUserInfo userInfo;
+			if (!db->GetUserByName(username, &userInfo))
+			{
+				db->CreateUser(username);
+			}
+		},
+		[username](RemoteClient* client, bool succeeded)
+		{
+			LoginResult result = succeeded ? sApp->CreateLoginSession(username, &client->userId) : LoginResult::Failed;
+			client->CompletePacket_Login(username, result);
+		});
+
+		return ClientProcessingResult::Continue;
+	}
+
+	this->CompletePacket_Login(packet->username, result);
+	return ClientProcessingResult::Continue;
+}
+
+void RemoteClient::CompletePacket_Login(const std::string& username, LoginResult result)
+{
 	if (result == LoginResult::Success)
 	{
-		this->username = packet->username;
+		this->username = username;
+		sApp->RegisterLoginSession(this);
 		LogInfo("%s logs in as \xb0\x0b%s\xb0\x0f (%I64u)", this->ipAddress.c_str(), this->username.c_str(), this->userId);
 	}
 
@@ -31,10 +61,10 @@ ClientProcessingResult RemoteClient::ProcessPacket_Login(PKT_C2S_Login* packet)
 	if (result == LoginResult::Success)
 	{
 		this->SendChatList();
-		return ClientProcessingResult::Continue;
+		return;
 	}
 
-	return ClientProcessingResult::CloseConnection;
+	this->disconnectionInProgress = true;
 }
 
 ClientProcessingResult RemoteClient::ProcessPacket_CreateChat(PKT_C2S_CreateChat* packet)
@@ -44,11 +74,8 @@ ClientProcessingResult RemoteClient::ProcessPacket_CreateChat(PKT_C2S_CreateChat
 		return ClientProcessingResult::TerminateConnection;
 	}
 
-	ChatCreateResult result = sApp->CreateChat(this->userId, packet->userIDs, packet->isGroupChat);
-	if (result == ChatCreateResult::Success)
-	{
-		LogInfo("New%schat created by \xb0\x0b%s\xb0\x0f", packet->isGroupChat ? " group " : " ", this->username.c_str());
-	}
+	// The chat is announced to its participants once it has been created on the database thread
+	sApp->CreateChat(this, packet->userIDs, packet->isGroupChat);
 
 	return ClientProcessingResult::Continue;
 }
@@ -109,58 +136,122 @@ ClientProcessingResult RemoteClient::ProcessPacket_OpenChat(PKT_C2S_OpenChat* pa
 
 	LogInfo("\xb0\x0b%s\xb0\x0f is opening chat %u", this->username.c_str(), packet->chatId);
 
-	DatabaseChatMessages chatMessages;
-	sApp->GetDB()->GetChatMessages(packet->chatId, &chatMessages);
-
 	this->SetActiveChatID(packet->chatId);
 
+	// Only the most recent page is sent, older messages are requested by the client when needed. It's loaded on the database thread.
+	uint64_t chatId = packet->chatId;
+	size_t pageSize = sApp->GetConfig().chatHistoryPageSize;
+	std::shared_ptr<DatabaseChatMessages> chatMessages = std::make_shared<DatabaseChatMessages>();
+
+	this->RunDatabaseRequest([chatId, pageSize, chatMessages](DatabaseInterface* db)
+	{
+		db->GetChatMessages(chatId, 0, pageSize, chatMessages.get());
+	},
+	[chatId, chatMessages](RemoteClient* client, bool succeeded)
+	{
+		client->CompletePacket_OpenChat(chatId, chatMessages.get(), succeeded);
+	});
+
+	return ClientProcessingResult::Continue;
+}
+
+void RemoteClient::CompletePacket_OpenChat(uint64_t chatId, DatabaseChatMessages* chatMessages, bool succeeded)
+{
+	// The chat may have been closed in the meantime (e.g. the user has been removed from it)
+	if (this->openChatId != chatId)
+	{
+		return;
+	}
+
+	if (!succeeded)
+	{
+		this->ShowMessageBox("The chat could not be opened, please try again.", false);
+		return;
+	}
+
 	PKT_S2C_OpenChatAns response;
-	response.messages = chatMessages.messages;
+	response.messages = std::move(chatMessages->messages);
+	response.historyCursor = chatMessages->historyCursor;
 
 	this->SendPacket(response.Serialize());
 
-	sApp->SetChatReadByUser(packet->chatId, this->GetUserID());
+	sApp->SetChatReadByUser(chatId, this->GetUserID());
 	this->SendParticipantList();
-
-	return ClientProcessingResult::Continue;
 }
 
-ClientProcessingResult RemoteClient::ProcessPacket_SendMessage(PKT_C2S_SendMessage* packet)
+ClientProcessingResult RemoteClient::ProcessPacket_RequestChatHistory(PKT_C2S_RequestChatHistory* packet)
 {
 	if (!this->IsLoggedIn())
 	{
 		return ClientProcessingResult::TerminateConnection;
 	}
 
-	if (this->openChatId == INVALID_CHAT_ID)
+	// History can only be browsed in the chat that's currently open (the client may have switched chats in the meantime)
+	if (packet->chatId == INVALID_CHAT_ID || packet->chatId != this->openChatId || packet->beforeMessageId == 0)
 	{
 		return ClientProcessingResult::Continue;
 	}
 
-	LogInfo("\xb0\x0b%s\xb0\x0f sent a message in chat %u", this->username.c_str(), this->openChatId);
+	uint64_t chatId = packet->chatId;
+	uint64_t beforeMessageId = packet->beforeMessageId;
+	size_t pageSize = sApp->GetConfig().chatHistoryPageSize;
+	std::shared_ptr<DatabaseChatMessages> chatMessages = std::make_shared<DatabaseChatMessages>();
 
-	uint64_t msgTimestamp;
-	sApp->GetDB()->AddChatMessage(this->openChatId, this->userId, packet->message, &msgTimestamp);
+	this->RunDatabaseRequest([chatId, beforeMessageId, pageSize, chatMessages](DatabaseInterface* db)
+	{
+		db->GetChatMessages(chatId, beforeMessageId, pageSize, chatMessages.get());
+	},
+	[chatId, beforeMessageId, chatMessages](RemoteClient* client, bool succeeded)
+	{
+		client->CompletePacket_RequestChatHistory(chatId, beforeMessageId, chatMessages.get(), succeeded);
+	});
 
-	PKT_S2C_NewMessage response;
-	response.chatId = this->openChatId;
-	response.message.author = this->userId;
-	response.message.message = packet->message;
-	response.message.filePromiseId = 0;
-	response.message.sentTimestamp = msgTimestamp;
+	return ClientProcessingResult::Continue;
+}
 
-	DatabaseChatRoomInfo chatInfo;
-	sApp->GetDB()->GetChatById(this->openChatId, &chatInfo);
+void RemoteClient::CompletePacket_RequestChatHistory(uint64_t chatId, uint64_t beforeMessageId, DatabaseChatMessages* chatMessages, bool succeeded)
+{
+	if (this->openChatId != chatId)
+	{
+		return;
+	}
 
-	for (uint64_t participantId : chatInfo.allParticipants)
+	PKT_S2C_ChatHistoryPage response;
+	response.chatId = chatId;
+	response.beforeMessageId = beforeMessageId;
+
+	if (succeeded)
 	{
-		RemoteClient* client = sApp->GetLoggedInClient(participantId);
-		if (client)
-		{
-			client->SendPacket(response.Serialize());
-		}
+		response.messages = std::move(chatMessages->messages);
+		response.historyCursor = chatMessages->historyCursor;
+	}
+	else
+	{
+		// The client waits for an answer before it requests another page; an empty one that keeps the cursor lets it try again
+		response.historyCursor = beforeMessageId;
+		this->ShowMessageBox("Older messages could not be loaded, please try again.", false);
+	}
+
+	this->SendPacket(response.Serialize());
+}
+
+ClientProcessingResult RemoteClient::ProcessPacket_SendMessage(PKT_C2S_SendMessage* packet)
+{
+	if (!this->IsLoggedIn())
+	{
+		return ClientProcessingResult::TerminateConnection;
+	}
+
+	if (this->openChatId == INVALID_CHAT_ID)
+	{
+		return ClientProcessingResult::Continue;
 	}
 
+	LogInfo("\xb0\x0b%s\xb0\x0f sent a message in chat %u", this->username.c_str(), this->openChatId);
+
+	// The message is delivered to the participants once its batch is committed
+	sApp->QueueChatMessage(this, this->openChatId, packet->message);
+
 	return ClientProcessingResult::Continue;
 }
 
@@ -178,48 +269,25 @@ ClientProcessingResult RemoteClient::ProcessPacket_AddRemoveUser(PKT_C2S_AddRemo
 
 	LogInfo("\xb0\x0b%s\xb0\x0f %s user %u", this->username.c_str(), packet->isRemoveAction ? "removes" : "adds", packet->userId);
 
-	DatabaseChatRoomInfo chatInfo;
-	sApp->GetDB()->GetChatById(this->openChatId, &chatInfo);
+	const ChatDirectoryEntry* chat = sApp->GetChatDirectory()->Find(this->openChatId);
+	if (!chat)
+	{
+		return ClientProcessingResult::Continue;
+	}
 
 	if (packet->isRemoveAction)
 	{
-		sApp->GetDB()->RemoveUserFromChat(this->openChatId, packet->userId);
-		
-		RemoteClient* removedClient = sApp->GetLoggedInClient(packet->userId);
-		if (removedClient)
-		{
-			removedClient->SendChatList();
-		}
+		sApp->RemoveChatParticipant(this, this->openChatId, packet->userId);
 	}
 	else
 	{
-		if (std::find(chatInfo.allParticipants.begin(), chatInfo.allParticipants.end(), packet->userId) != chatInfo.allParticipants.end())
+		if (chat->HasParticipant(packet->userId))
 		{
 			this->ShowMessageBox("The user you are trying to add is already in this group.", false);
 			return ClientProcessingResult::Continue;
 		}
 
-		sApp->GetDB()->AddChatParticipant(this->openChatId, packet->userId);
-
-		RemoteClient* addedClient = sApp->GetLoggedInClient(packet->userId);
-		if (addedClient)
-		{
-			PKT_S2C_NewChat newChatPkt;
-			newChatPkt.chatID = chatInfo.chatRoomId;
-			newChatPkt.chatName = chatInfo.chatName;
-			newChatPkt.flashWindow = true;
-
-			addedClient->SendPacket(newChatPkt.Serialize());
-		}
-	}
-
-	for (uint64_t participantId : chatInfo.allParticipants)
-	{
-		RemoteClient* client = sApp->GetLoggedInClient(participantId);
-		if (client && client->GetActiveChatID() == chatInfo.chatRoomId)
-		{
-			client->SendParticipantList();
-		}
+		sApp->AddChatParticipant(this, this->openChatId, packet->userId);
 	}
 
 	return ClientProcessingResult::Continue;
@@ -237,20 +305,14 @@ ClientProcessingResult RemoteClient::ProcessPacket_RenameChat(PKT_C2S_RenameChat
 		return ClientProcessingResult::Continue;
 	}
 
-	sApp->GetDB()->RenameChat(this->openChatId, packet->newName);
-
-	DatabaseChatRoomInfo chatInfo;
-	sApp->GetDB()->GetChatById(this->openChatId, &chatInfo);
-
-	for (uint64_t participantId : chatInfo.allParticipants)
+	const ChatDirectoryEntry* chat = sApp->GetChatDirectory()->Find(this->openChatId);
+	if (!chat)
 	{
-		RemoteClient* client = sApp->GetLoggedInClient(participantId);
-		if (client)
-		{
-			client->SendChatList();
-		}
+		return ClientProcessingResult::Continue;
 	}
 
+	sApp->RenameChat(this, this->openChatId, packet->newName);
+
 	return ClientProcessingResult::Continue;
 }
 
@@ -270,27 +332,8 @@ ClientProcessingResult RemoteClient::ProcessPacket_FilePromise(PKT_C2S_FilePromi
 
 	sApp->AddFilePromise(packet->promiseId, this->userId);
 
-	uint64_t msgTimestamp;
-	sApp->GetDB()->AddFilePromiseMessage(this->openChatId, this->userId, packet->promiseId, packet->fileName, &msgTimestamp);
-
-	PKT_S2C_NewMessage response;
-	response.chatId = this->openChatId;
-	response.message.author = this->userId;
-	response.message.message = packet->fileName;
-	response.message.filePromiseId = packet->promiseId;
-	response.message.sentTimestamp = msgTimestamp;
-
-	DatabaseChatRoomInfo chatInfo;
-	sApp->GetDB()->GetChatById(this->openChatId, &chatInfo);
-
-	for (uint64_t participantId : chatInfo.allParticipants)
-	{
-		RemoteClient* client = sApp->GetLoggedInClient(participantId);
-		if (client)
-		{
-			client->SendPacket(response.Serialize());
-		}
-	}
+	// Like regular messages, file promises are delivered once their batch is committed
+	sApp->QueueChatMessage(this, this->openChatId, packet->fileName, packet->promiseId);
 
 	return ClientProcessingResult::Continue;
 }
@@ -340,6 +383,7 @@ ClientProcessingResult RemoteClient::ProcessPacket_SendFileChunk(PKT_C2S_SendFil
 	RemoteClient* fileRecipient = sApp->GetLoggedInClient(this->fileNextRecipient);
 	if (fileRecipient)
 	{
+		// The chunk is copied from the receive buffer straight into the outgoing packet
 		PKT_S2C_ReceiveFileChunk pkt;
 		pkt.fileData = packet->fileData;
 
@@ -352,64 +396,28 @@ ClientProcessingResult RemoteClient::ProcessPacket_SendFileChunk(PKT_C2S_SendFil
 
 ClientProcessingResult RemoteClient::ProcessPacket(NetPacket* packet)
 {
+	// Every packet a client may send, along with its handler; the packet is decoded on the stack
+	using ClientPacketDispatcher = PacketDispatcher<
+		PacketHandler<&RemoteClient::ProcessPacket_Login>,
+		PacketHandler<&RemoteClient::ProcessPacket_ResolveUsername>,
+		PacketHandler<&RemoteClient::ProcessPacket_CreateChat>,
+		PacketHandler<&RemoteClient::ProcessPacket_OpenChat>,
+		PacketHandler<&RemoteClient::ProcessPacket_RequestChatHistory>,
+		PacketHandler<&RemoteClient::ProcessPacket_SendMessage>,
+		PacketHandler<&RemoteClient::ProcessPacket_AddRemoveUser>,
+		PacketHandler<&RemoteClient::ProcessPacket_RenameChat>,
+		PacketHandler<&RemoteClient::ProcessPacket_FilePromise>,
+		PacketHandler<&RemoteClient::ProcessPacket_RequestFile>,
+		PacketHandler<&RemoteClient::ProcessPacket_SendFileChunk>>;
+
 	PacketHeader header = packet->ReadField<PacketHeader>();
 
-	switch (header)
-	{
-	case PacketHeader::C2S_Login:
-	{
-		std::unique_ptr<PKT_C2S_Login> pkt = PKT_C2S_Login::Deserialize(packet);
-		return this->ProcessPacket_Login(pkt.get());
-	}
-	case PacketHeader::C2S_ResolveUsername:
-	{
-		std::unique_ptr<PKT_C2S_ResolveUsername> pkt = PKT_C2S_ResolveUsername::Deserialize(packet);
-		return this->ProcessPacket_ResolveUsername(pkt.get());
-	}
-	case PacketHeader::C2S_CreateChat:
-	{
-		std::unique_ptr<PKT_C2S_CreateChat> pkt = PKT_C2S_CreateChat::Deserialize(packet);
-		return this->ProcessPacket_CreateChat(pkt.get());
-	}
-	case PacketHeader::C2S_OpenChat:
-	{
-		std::unique_ptr<PKT_C2S_OpenChat> pkt = PKT_C2S_OpenChat::Deserialize(packet);
-		return this->ProcessPacket_OpenChat(pkt.get());
-	}
-	case PacketHeader::C2S_SendMessage:
-	{
-		std::unique_ptr<PKT_C2S_SendMessage> pkt = PKT_C2S_SendMessage::Deserialize(packet);
-		return this->ProcessPacket_SendMessage(pkt.get());
-	}
-	case PacketHeader::C2S_AddRemoveUser:
-	{
-		std::unique_ptr<PKT_C2S_AddRemoveUser> pkt = PKT_C2S_AddRemoveUser::Deserialize(packet);
-		return this->ProcessPacket_AddRemoveUser(pkt.get());
-	}
-	case PacketHeader::C2S_RenameChat:
-	{
-		std::unique_ptr<PKT_C2S_RenameChat> pkt = PKT_C2S_RenameChat::Deserialize(packet);
-		return this->ProcessPacket_RenameChat(pkt.get());
-	}
-	case PacketHeader::C2S_FilePromise:
-	{
-		std::unique_ptr<PKT_C2S_FilePromise> pkt = PKT_C2S_FilePromise::Deserialize(packet);
-		return this->ProcessPacket_FilePromise(pkt.get());
-	}
-	case PacketHeader::C2S_RequestFile:
-	{
-		std::unique_ptr<PKT_C2S_RequestFile> pkt = PKT_C2S_RequestFile::Deserialize(packet);
-		return this->ProcessPacket_RequestFile(pkt.get());
-	}
-	case PacketHeader::C2S_SendFileChunk:
-	{
-		std::unique_ptr<PKT_C2S_SendFileChunk> pkt = PKT_C2S_SendFileChunk::Deserialize(packet);
-		return this->ProcessPacket_SendFileChunk(pkt.get());
-	}
-	default:
+	ClientProcessingResult result;
+	if (!ClientPacketDispatcher::Dispatch(this, header, packet, &result))
 	{
 		LogWarning("Received a packet with unknown header %u", header);
 		return ClientProcessingResult::TerminateConnection;
 	}
-	}
+
+	return result;
 }
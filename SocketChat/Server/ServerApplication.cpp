@@ -1,6 +1,8 @@
 #include "ServerApplication.h"
 #include "RemoteClient.h"
 #include "DatabaseInterface.h"
+#include "DatabaseWorker.h"
+#include "ChatDirectory.h"
 #include "../Logger.h"
 #include "../Packets/NetPacket.h"
 #include "../Packets/Protocol.h"
@@ -15,9 +17,14 @@ ServerSocketApp* sApp;
 
 ServerSocketApp::ServerSocketApp()
 {
-	this->dbConnection = std::make_unique<DatabaseInterface>("E:\\chatserver.db");
+	// The network thread keeps its own connection for quick lookups, all writes and history reads go to the database thread
+	this->dbConnection = std::make_unique<DatabaseInterface>(this->config.database);
+	this->dbWorker = std::make_unique<DatabaseWorker>(this->config.database);
+	this->chatDirectory = std::make_unique<ChatDirectory>(this->dbConnection.get());
 	LogInfo("Database loaded");
 
+	this->pendingMessagesDeadline = 0;
+
 	// Create a server socket; an IPv6 socket can handle both IPv4 and IPv6 connections
 	this->serverSocket = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 
@@ -72,15 +79,52 @@ ServerSocketApp::~ServerSocketApp()
 
 RemoteClient* ServerSocketApp::GetLoggedInClient(uint64_t userId)
 {
-	for (const auto& client : this->connectedClients)
+	auto sessionIt = this->loggedInClientsById.find(userId);
+	if (sessionIt == this->loggedInClientsById.end())
 	{
-		if (client->IsLoggedIn() && client->GetUserID() == userId)
+		return nullptr;
+	}
+
+	return sessionIt->second;
+}
+
+void ServerSocketApp::SendFrameToUsers(const std::vector<uint64_t>& userIds, const SharedNetFrame& frame)
+{
+	for (uint64_t userId : userIds)
+	{
+		RemoteClient* client = this->GetLoggedInClient(userId);
+		if (client)
 		{
-			return client.get();
+			client->SendFrame(frame);
 		}
 	}
+}
 
-	return nullptr;
+void ServerSocketApp::RegisterLoginSession(RemoteClient* client)
+{
+	this->loggedInClientsById[client->GetUserID()] = client;
+	this->loggedInClientsByName[client->GetUsername()] = client;
+}
+
+void ServerSocketApp::UnregisterLoginSession(RemoteClient* client)
+{
+	auto idIt = this->loggedInClientsById.find(client->GetUserID());
+	if (idIt != this->loggedInClientsById.end() && idIt->second == client)
+	{
+		this->loggedInClientsById.erase(idIt);
+
+		// The user has gone offline, so the time is stored with the next flush (at the end of this pass)
+		this->pendingLastSeenUsers.push_back(client->GetUserID());
+
+		// The user's chats are evicted from the directory once the read marks are stored, unless somebody else is online in them
+		this->pendingEvictions.push_back(client->GetUserID());
+	}
+
+	auto nameIt = this->loggedInClientsByName.find(client->GetUsername());
+	if (nameIt != this->loggedInClientsByName.end() && nameIt->second == client)
+	{
+		this->loggedInClientsByName.erase(nameIt);
+	}
 }
 
 void ServerSocketApp::AcceptIncomingConnections()
@@ -92,7 +136,7 @@ void ServerSocketApp::AcceptIncomingConnections()
 	while ((clientSocket = accept(this->serverSocket, (sockaddr*)&clientAddr, &clientAddrLen)) != INVALID_SOCKET)
 	{
 		this->SetSocketNonBlocking(clientSocket);
-		connectedClients.push_back(std::make_unique<RemoteClient>(clientSocket, &clientAddr));
+		connectedClients.push_back(std::make_shared<RemoteClient>(clientSocket, &clientAddr));
 	}
 
 	// this "error" simply means that no connections were available and accept() returned nothing
@@ -103,12 +147,98 @@ void ServerSocketApp::AcceptIncomingConnections()
 	}
 }
 
+void ServerSocketApp::PreparePollDescriptors()
+{
+	this->pollDescriptors.resize(FirstClientPollIndex + this->connectedClients.size());
+
+	this->pollDescriptors[ListeningSocketPollIndex].fd = this->serverSocket;
+	this->pollDescriptors[ListeningSocketPollIndex].events = POLLRDNORM;
+	this->pollDescriptors[ListeningSocketPollIndex].revents = 0;
+
+	this->pollDescriptors[DatabaseWakeupPollIndex].fd = this->dbWorker->GetWakeupSocket();
+	this->pollDescriptors[DatabaseWakeupPollIndex].events = POLLRDNORM;
+	this->pollDescriptors[DatabaseWakeupPollIndex].revents = 0;
+
+	this->hasBufferedPackets = false;
+	this->hasOverflowedClients = false;
+
+	for (size_t i = 0; i < this->connectedClients.size(); ++i)
+	{
+		RemoteClient* client = this->connectedClients[i].get();
+
+		// Clients that still have unprocessed packets don't get read interest, so that their buffer doesn't grow any further
+		// Clients waiting for the database thread can't make progress on their backlog until the wakeup socket fires
+		bool hasBacklog = client->HasBufferedPackets();
+		this->hasBufferedPackets |= hasBacklog && !client->IsWaitingForDatabase();
+		this->hasOverflowedClients |= client->HasSendQueueOverflowed();
+
+		this->pollDescriptors[FirstClientPollIndex + i].fd = client->GetSocket();
+		this->pollDescriptors[FirstClientPollIndex + i].events = (hasBacklog ? 0 : POLLRDNORM) | (client->WantsToWrite() ? POLLWRNORM : 0);
+		this->pollDescriptors[FirstClientPollIndex + i].revents = 0;
+	}
+}
+
+int ServerSocketApp::GetPollTimeout()
+{
+	// Buffered packets must be processed right away, they won't be reported by WSAPoll(); neither will overflowed send queues
+	if (this->hasBufferedPackets || this->hasOverflowedClients)
+	{
+		return 0;
+	}
+
+	uint64_t wakeupTick = std::min({ this->nextHousekeepingTick, this->nextCheckpointTick, this->nextPresenceFlushTick });
+	if (!this->pendingMessages.empty())
+	{
+		wakeupTick = std::min(wakeupTick, this->pendingMessagesDeadline);
+	}
+
+	uint64_t currentTick = GetTickCount64();
+	if (currentTick >= wakeupTick)
+	{
+		return 0;
+	}
+
+	return (int)(wakeupTick - currentTick);
+}
+
 void ServerSocketApp::UpdateConnections()
 {
 	for (size_t i = 0; i < this->connectedClients.size(); ++i)
 	{
 		RemoteClient* client = this->connectedClients[i].get();
-		ClientProcessingResult result = client->Update();
+		short readyEvents = this->pollDescriptors[FirstClientPollIndex + i].revents;
+		ClientProcessingResult result;
+
+		if (client->HasSendQueueOverflowed())
+		{
+			// the client stopped reading and its send queue hit the hard limit, it doesn't matter whether its socket is ready
+			LogWarning("Dropping slow client %s (%zu bytes queued)", client->GetIPAddress().c_str(), client->GetQueuedBytes());
+			result = ClientProcessingResult::TerminateConnection;
+		}
+		else if (readyEvents & POLLNVAL)
+		{
+			// the socket is no longer valid, WSAPoll() would keep reporting it (and return immediately) for as long as it's polled
+			LogWarning("Dropping client %s with an invalid socket", client->GetIPAddress().c_str());
+			result = ClientProcessingResult::TerminateConnection;
+		}
+		else if ((readyEvents & (POLLHUP | POLLERR)) && client->IsWaitingForDatabase())
+		{
+			// hangups and errors are consumed by recv(), which isn't called until the client's database request is done, so WSAPoll()
+			// would keep reporting them (and return immediately) in the meantime; the peer is gone, so it's dropped right away
+			result = (readyEvents & POLLERR) ? ClientProcessingResult::TerminateConnection : ClientProcessingResult::CloseConnection;
+		}
+		else if (readyEvents == 0 && (!client->HasBufferedPackets() || client->IsWaitingForDatabase()))
+		{
+			continue;
+		}
+		else
+		{
+			// errors and hangups are reported through recv(), so we treat them as readability
+			bool isReadable = (readyEvents & (POLLRDNORM | POLLERR | POLLHUP)) != 0;
+			bool isWritable = (readyEvents & POLLWRNORM) != 0;
+
+			result = client->Update(isReadable, isWritable);
+		}
 
 		if (result == ClientProcessingResult::Continue)
 		{
@@ -121,47 +251,227 @@ void ServerSocketApp::UpdateConnections()
 				client->ResetConnectionOnClose();
 			}
 
+			if (client->IsLoggedIn())
+			{
+				this->UnregisterLoginSession(client);
+			}
+
 			// This will trigger RemoteClient's destructor and thus close the socket
+			// The poll descriptors are swapped as well, so that they keep matching their clients
 			this->connectedClients[i].swap(this->connectedClients[this->connectedClients.size() - 1]);
 			this->connectedClients.pop_back();
+
+			std::swap(this->pollDescriptors[FirstClientPollIndex + i], this->pollDescriptors[this->pollDescriptors.size() - 1]);
+			this->pollDescriptors.pop_back();
 			--i;
 		}
 	}
 }
 
-void ServerSocketApp::UpdateLastSeenTimes()
+void ServerSocketApp::RunHousekeepingTimer()
+{
+	uint64_t currentTick = GetTickCount64();
+	if (currentTick < this->nextHousekeepingTick)
+	{
+		return;
+	}
+
+	this->UpdateParticipantLists();
+	this->LogMetrics();
+
+	this->nextHousekeepingTick = currentTick + HousekeepingIntervalMs;
+}
+
+void ServerSocketApp::LogMetrics()
+{
+	if (this->metrics.slowConsumerFramesDropped == this->loggedMetrics.slowConsumerFramesDropped &&
+		this->metrics.slowConsumerFramesCoalesced == this->loggedMetrics.slowConsumerFramesCoalesced &&
+		this->metrics.slowConsumerDisconnects == this->loggedMetrics.slowConsumerDisconnects)
+	{
+		return;
+	}
+
+	LogInfo("Slow consumers: %I64u frames dropped, %I64u frames coalesced, %I64u clients disconnected (totals since startup)",
+		this->metrics.slowConsumerFramesDropped, this->metrics.slowConsumerFramesCoalesced, this->metrics.slowConsumerDisconnects);
+
+	this->loggedMetrics = this->metrics;
+}
+
+void ServerSocketApp::RunCheckpointTimer()
 {
-	for (const auto& client : this->connectedClients)
+	uint64_t currentTick = GetTickCount64();
+	if (currentTick < this->nextCheckpointTick)
+	{
+		return;
+	}
+
+	this->nextCheckpointTick = currentTick + this->config.checkpointIntervalMs;
+
+	// A checkpoint that takes longer than the interval isn't stacked with another one
+	if (this->isCheckpointRunning)
+	{
+		return;
+	}
+
+	this->isCheckpointRunning = true;
+	this->dbWorker->Submit([](DatabaseInterface* db)
+	{
+		db->Checkpoint();
+	},
+	[](bool succeeded)
+	{
+		sApp->isCheckpointRunning = false;
+	});
+}
+
+void ServerSocketApp::RunPresenceTimer()
+{
+	uint64_t currentTick = GetTickCount64();
+	if (currentTick < this->nextPresenceFlushTick)
+	{
+		return;
+	}
+
+	// Online users are shown as such from memory, their stored "last seen" time only matters after a crash
+	for (const auto& session : this->loggedInClientsById)
+	{
+		this->pendingLastSeenUsers.push_back(session.first);
+	}
+
+	this->nextPresenceFlushTick = currentTick + this->config.presenceFlushIntervalMs;
+}
+
+void ServerSocketApp::FlushLastSeenTimes()
+{
+	if (this->pendingLastSeenUsers.empty())
+	{
+		return;
+	}
+
+	std::shared_ptr<std::vector<uint64_t>> userIds = std::make_shared<std::vector<uint64_t>>();
+	userIds->swap(this->pendingLastSeenUsers);
+
+	this->dbWorker->Submit([userIds](DatabaseInterface* db)
 	{
-		if (client->IsLoggedIn())
+		db->UpdateLastSeenTimes(*userIds);
+	},
+	[](bool succeeded)
+	{
+		if (!succeeded)
 		{
-			this->dbConnection->UpdateLastSeenTime(client->GetUserID());
+			LogWarning("Failed to store last seen times");
 		}
+	});
+}
+
+void ServerSocketApp::FlushReadMarks()
+{
+	if (this->pendingReadMarks.empty() && this->pendingEvictions.empty())
+	{
+		return;
 	}
+
+	std::shared_ptr<std::vector<ChatReadMark>> readMarks = std::make_shared<std::vector<ChatReadMark>>();
+	readMarks->swap(this->pendingReadMarks);
+
+	std::shared_ptr<std::vector<uint64_t>> offlineUsers = std::make_shared<std::vector<uint64_t>>();
+	offlineUsers->swap(this->pendingEvictions);
+
+	// Evictions go through the database thread even without any read marks, so that the ones submitted earlier are stored first
+	this->dbWorker->Submit([readMarks](DatabaseInterface* db)
+	{
+		if (!readMarks->empty())
+		{
+			db->SetChatsRead(*readMarks);
+		}
+	},
+	[offlineUsers](bool succeeded)
+	{
+		if (!succeeded)
+		{
+			// the directory keeps the only copy of the read state then, so nothing is evicted
+			LogWarning("Failed to store read receipts");
+			return;
+		}
+
+		// A chat loaded again later reads the stored read state, which is up to date now
+		for (uint64_t userId : *offlineUsers)
+		{
+			sApp->chatDirectory->EvictChatsOfUser(userId, [](uint64_t participantId) { return sApp->GetLoggedInClient(participantId) != nullptr; });
+		}
+	});
 }
 
-void ServerSocketApp::UpdateReadReceipts()
+void ServerSocketApp::UpdateParticipantLists()
 {
-	for (const auto& client : this->connectedClients)
+	// Every viewer of a chat gets the same list, so it's queried and serialized once per chat
+	std::unordered_map<uint64_t, SharedNetFrame> framesByChat;
+
+	for (const auto& session : this->loggedInClientsById)
 	{
-		if (client->IsLoggedIn() && client->GetActiveChatID() != INVALID_CHAT_ID)
+		RemoteClient* client = session.second;
+		if (client->GetActiveChatID() == INVALID_CHAT_ID)
+		{
+			continue;
+		}
+
+		SharedNetFrame& frame = framesByChat[client->GetActiveChatID()];
+		if (!frame)
 		{
-			this->SetChatReadByUser(client->GetActiveChatID(), client->GetUserID());
+			frame = this->CreateParticipantListFrame(client->GetActiveChatID());
 		}
+
+		// participant lists are refreshed periodically, so a slow client can skip some of them
+		client->SendFrame(frame, true);
 	}
 }
 
-void ServerSocketApp::UpdateParticipantLists()
+void ServerSocketApp::SendParticipantListToViewers(const std::vector<uint64_t>& userIds, uint64_t chatId)
 {
-	for (const auto& client : this->connectedClients)
+	SharedNetFrame participantListFrame;
+	for (uint64_t userId : userIds)
 	{
-		if (client->IsLoggedIn() && client->GetActiveChatID() != INVALID_CHAT_ID)
+		RemoteClient* client = this->GetLoggedInClient(userId);
+		if (client && client->GetActiveChatID() == chatId)
 		{
-			client->SendParticipantList();
+			if (!participantListFrame)
+			{
+				participantListFrame = this->CreateParticipantListFrame(chatId);
+			}
+
+			client->SendFrame(participantListFrame, true);
 		}
 	}
 }
 
+SharedNetFrame ServerSocketApp::CreateParticipantListFrame(uint64_t chatId)
+{
+	DatabaseUserInfoList userList;
+	this->dbConnection->GetUsersInChat(chatId, &userList);
+
+	const ChatDirectoryEntry* chat = this->chatDirectory->Find(chatId);
+
+	for (size_t i = 0; i < userList.users.size(); ++i)
+	{
+		// Replace online users' "last seen time" with a special value that indicates that they're online
+		if (this->GetLoggedInClient(userList.users[i].userId))
+		{
+			userList.users[i].lastSeen = CURRENTLY_ONLINE;
+		}
+
+		// Read state in the database may still be waiting for the next flush
+		if (chat)
+		{
+			userList.users[i].hasReadChat = chat->HasRead(userList.users[i].userId);
+		}
+	}
+
+	PKT_S2C_ReplaceParticipantList pkt;
+	pkt.users = userList.users;
+
+	return NetFrame::Create(pkt.Serialize());
+}
+
 void ServerSocketApp::SetSocketNonBlocking(SOCKET s)
 {
 	// enable TCP_NODELAY to reduce latency
@@ -187,93 +497,355 @@ LoginResult ServerSocketApp::CreateLoginSession(std::string username, uint64_t*
 		return LoginResult::UsernameWrongLength;
 	}
 
-	// disconnect all existing users that are logged in with this username
-	for (const auto& client : this->connectedClients)
+	// disconnect the existing session that is logged in with this username (older sessions are already disconnecting)
+	auto existingSession = this->loggedInClientsByName.find(username);
+	if (existingSession != this->loggedInClientsByName.end())
 	{
-		if (client->IsLoggedIn() && client->GetUsername() == username)
-		{
-			client->ShowMessageBox("Logged out by another client", true);
-		}
+		existingSession->second->ShowMessageBox("Logged out by another client", true);
 	}
 
 	DatabaseUserInfo userInfo = { 0 };
 	if (!this->dbConnection->GetUserByName(username, &userInfo))
 	{
-		this->dbConnection->CreateUser(username);
-		this->dbConnection->GetUserByName(username, &userInfo);
+		return LoginResult::Failed;
 	}
 
 	*userId = userInfo.userId;
 	return LoginResult::Success;
 }
 
-ChatCreateResult ServerSocketApp::CreateChat(uint64_t ownerUserId, std::vector<uint64_t> participants, bool isGroupChat)
+void ServerSocketApp::SubmitChatChange(RemoteClient* requester, std::function<void(DatabaseInterface*)> work, std::function<void()> apply, const char* failureMessage)
 {
+	requester->BeginDatabaseRequest();
+
+	std::weak_ptr<RemoteClient> weakRequester = requester->weak_from_this();
+	this->dbWorker->Submit(std::move(work), [weakRequester, apply, failureMessage](bool succeeded)
+	{
+		std::shared_ptr<RemoteClient> requester = weakRequester.lock();
+		if (requester)
+		{
+			requester->EndDatabaseRequest();
+			if (!succeeded)
+			{
+				requester->ShowMessageBox(failureMessage, false);
+			}
+		}
+
+		// The change is in the database now, so the cached copy has to follow regardless of the requester
+		if (succeeded)
+		{
+			apply();
+		}
+	});
+}
+
+void ServerSocketApp::CreateChat(RemoteClient* owner, std::vector<uint64_t> participants, bool isGroupChat)
+{
+	uint64_t ownerUserId = owner->GetUserID();
 	participants.push_back(ownerUserId);
 
 	std::sort(participants.begin(), participants.end());
 	participants.erase(std::unique(participants.begin(), participants.end()), participants.end());
-	
-	DatabaseUserInfo userInfo;
-	for (uint64_t userId : participants)
+
+	std::shared_ptr<DatabaseChatRoomInfo> chatInfo = std::make_shared<DatabaseChatRoomInfo>();
+	chatInfo->chatRoomId = INVALID_CHAT_ID;
+
+	this->SubmitChatChange(owner, [ownerUserId, participants, isGroupChat, chatInfo](DatabaseInterface* db)
 	{
-		if (!this->dbConnection->GetUserById(userId, &userInfo))
+		// Participants are validated by the database while they're being inserted, all of them at once.
+		// The chat is read back once, since its name comes from the column default.
+		uint64_t chatId = db->CreateChat(ownerUserId, participants, isGroupChat);
+		if (chatId != INVALID_CHAT_ID)
 		{
-			return ChatCreateResult::UserNotFound;
+			db->GetChatById(chatId, chatInfo.get());
+		}
+	},
+	[ownerUserId, chatInfo]()
+	{
+		if (chatInfo->chatRoomId == INVALID_CHAT_ID)
+		{
+			return;
 		}
-	}
 
-	uint64_t chatId = this->dbConnection->CreateChat(ownerUserId, participants, isGroupChat);
+		const ChatDirectoryEntry* chat = sApp->chatDirectory->AddChat(*chatInfo);
+		LogInfo("New%schat %I64u created by user %I64u", chat->isGroupChat ? " group " : " ", chat->chatId, ownerUserId);
 
-	DatabaseChatRoomInfo chatInfo;
-	this->dbConnection->GetChatById(chatId, &chatInfo);
+		PKT_S2C_NewChat newChatPkt;
+		newChatPkt.chatID = chat->chatId;
+		newChatPkt.chatName = chat->chatName;
 
-	PKT_S2C_NewChat newChatPkt;
-	newChatPkt.chatID = chatId;
-	newChatPkt.chatName = chatInfo.chatName;
+		// flash the window for everybody except the one who created the chat room
+		newChatPkt.flashWindow = false;
+		SharedNetFrame ownerFrame = NetFrame::Create(newChatPkt.Serialize());
+
+		newChatPkt.flashWindow = true;
+		SharedNetFrame participantFrame = NetFrame::Create(newChatPkt.Serialize());
+
+		for (uint64_t userId : chat->participants)
+		{
+			RemoteClient* client = sApp->GetLoggedInClient(userId);
+			if (client)
+			{
+				client->SendFrame(userId == ownerUserId ? ownerFrame : participantFrame);
+			}
+		}
+	}, "The chat could not be created, please try again.");
+}
 
-	for (uint64_t userId : participants)
+void ServerSocketApp::AddChatParticipant(RemoteClient* requester, uint64_t chatId, uint64_t userId)
+{
+	this->SubmitChatChange(requester, [chatId, userId](DatabaseInterface* db)
 	{
-		// flash the window for everybody except the one who created the chat room
-		newChatPkt.flashWindow = userId != ownerUserId;
+		db->AddChatParticipant(chatId, userId);
+	},
+	[chatId, userId]()
+	{
+		const ChatDirectoryEntry* chat = sApp->chatDirectory->Find(chatId);
+		if (!chat)
+		{
+			return;
+		}
 
-		RemoteClient* client = sApp->GetLoggedInClient(userId);
-		if (client)
+		// Participant lists go to everybody who was in the chat before the change
+		std::vector<uint64_t> participants = chat->participants;
+		sApp->chatDirectory->AddParticipant(chatId, userId);
+
+		RemoteClient* addedClient = sApp->GetLoggedInClient(userId);
+		if (addedClient)
 		{
-			client->SendPacket(newChatPkt.Serialize());
+			PKT_S2C_NewChat newChatPkt;
+			newChatPkt.chatID = chat->chatId;
+			newChatPkt.chatName = chat->chatName;
+			newChatPkt.flashWindow = true;
+
+			addedClient->SendPacket(newChatPkt.Serialize());
 		}
-	}
 
-	return ChatCreateResult::Success;
+		sApp->SendParticipantListToViewers(participants, chatId);
+	}, "The user could not be added, please try again.");
 }
 
-void ServerSocketApp::SetChatReadByUser(uint64_t chatId, uint64_t userId)
+void ServerSocketApp::RemoveChatParticipant(RemoteClient* requester, uint64_t chatId, uint64_t userId)
 {
-	DatabaseChatRoomInfo chatInfo;
-	if (!this->dbConnection->GetChatById(chatId, &chatInfo))
+	this->SubmitChatChange(requester, [chatId, userId](DatabaseInterface* db)
 	{
-		return;
-	}
+		db->RemoveUserFromChat(chatId, userId);
+	},
+	[chatId, userId]()
+	{
+		const ChatDirectoryEntry* chat = sApp->chatDirectory->Find(chatId);
+		if (!chat)
+		{
+			return;
+		}
+
+		// Participant lists go to everybody who was in the chat before the change
+		std::vector<uint64_t> participants = chat->participants;
+		sApp->chatDirectory->RemoveParticipant(chatId, userId);
+
+		RemoteClient* removedClient = sApp->GetLoggedInClient(userId);
+		if (removedClient)
+		{
+			removedClient->SendChatList();
+		}
 
-	if (!this->dbConnection->SetChatReadByUser(chatId, userId))
+		sApp->SendParticipantListToViewers(participants, chatId);
+	}, "The user could not be removed, please try again.");
+}
+
+void ServerSocketApp::RenameChat(RemoteClient* requester, uint64_t chatId, std::string newName)
+{
+	this->SubmitChatChange(requester, [chatId, newName](DatabaseInterface* db)
+	{
+		db->RenameChat(chatId, newName);
+	},
+	[chatId, newName]()
+	{
+		const ChatDirectoryEntry* chat = sApp->chatDirectory->Find(chatId);
+		if (!chat)
+		{
+			return;
+		}
+
+		sApp->chatDirectory->RenameChat(chatId, newName);
+
+		for (uint64_t participantId : chat->participants)
+		{
+			RemoteClient* client = sApp->GetLoggedInClient(participantId);
+			if (client)
+			{
+				client->SendChatList();
+			}
+		}
+	}, "The chat could not be renamed, please try again.");
+}
+
+void ServerSocketApp::SetChatReadByUser(uint64_t chatId, uint64_t userId)
+{
+	const ChatDirectoryEntry* chat = this->chatDirectory->Find(chatId);
+	if (!chat || !this->AdvanceReadWatermark(chatId, userId))
 	{
 		return;
 	}
 
 	LogInfo("Read receipt updated in chat %u for user %u", chatId, userId);
 
-	PKT_S2C_ChatReadReceipt pkt;
+	PKT_S2C_ReadWatermark pkt;
 	pkt.chatId = chatId;
 	pkt.userId = userId;
+	pkt.lastReadMessageId = chat->lastMessageId;
 
-	for (uint64_t participantId : chatInfo.allParticipants)
+	this->SendFrameToUsers(chat->participants, NetFrame::Create(pkt.Serialize()));
+}
+
+bool ServerSocketApp::AdvanceReadWatermark(uint64_t chatId, uint64_t userId)
+{
+	if (!this->chatDirectory->MarkRead(chatId, userId))
 	{
-		RemoteClient* client = sApp->GetLoggedInClient(participantId);
-		if (client)
+		return false;
+	}
+
+	ChatReadMark readMark;
+	readMark.chatId = chatId;
+	readMark.userId = userId;
+	readMark.lastReadMessageId = this->chatDirectory->Find(chatId)->lastMessageId;
+	this->pendingReadMarks.push_back(readMark);
+
+	return true;
+}
+
+void ServerSocketApp::QueueChatMessage(RemoteClient* sender, uint64_t chatId, std::string_view message, uint64_t filePromiseId)
+{
+	// Loads the chat into the directory now (if it isn't there yet), so that delivering the message only needs the cached participants
+	if (!this->chatDirectory->Find(chatId))
+	{
+		return;
+	}
+
+	if (this->pendingMessages.empty())
+	{
+		this->pendingMessagesDeadline = GetTickCount64() + this->config.messageBatchMaxDelayMs;
+	}
+
+	PendingChatMessage pending;
+	pending.chatId = chatId;
+	pending.senderId = sender->GetUserID();
+	pending.filePromiseId = filePromiseId;
+	pending.message = std::string(message); // the only copy made of a received message
+	pending.sentTimestamp = 0;
+	pending.messageId = 0;
+
+	this->pendingMessages.push_back(std::move(pending));
+	this->pendingMessageSenders.push_back(sender->weak_from_this());
+
+	// The sender's next packets are processed once the message has been committed
+	sender->BeginDatabaseRequest();
+
+	if (this->pendingMessages.size() >= this->config.messageBatchMaxSize)
+	{
+		this->FlushPendingMessages();
+	}
+}
+
+// A batch of messages on its way through the database thread
+struct ChatMessageBatch {
+	std::vector<PendingChatMessage> messages;
+	std::vector<std::weak_ptr<RemoteClient>> senders;
+
+	// Filled in on the database thread: the frame of every message
+	std::vector<SharedNetFrame> frames;
+};
+
+void ServerSocketApp::FlushPendingMessages()
+{
+	if (this->pendingMessages.empty())
+	{
+		return;
+	}
+
+	std::shared_ptr<ChatMessageBatch> batch = std::make_shared<ChatMessageBatch>();
+	batch->messages.swap(this->pendingMessages);
+	batch->senders.swap(this->pendingMessageSenders);
+
+	this->dbWorker->Submit([batch](DatabaseInterface* db)
+	{
+		db->AddChatMessages(batch->messages);
+
+		for (const PendingChatMessage& pending : batch->messages)
 		{
-			client->SendPacket(pkt.Serialize());
+			PKT_S2C_NewMessage pkt;
+			pkt.chatId = pending.chatId;
+			pkt.message.author = pending.senderId;
+			pkt.message.message = pending.message;
+			pkt.message.filePromiseId = pending.filePromiseId;
+			pkt.message.sentTimestamp = pending.sentTimestamp;
+
+			batch->frames.push_back(NetFrame::Create(pkt.Serialize()));
 		}
-	}
+	},
+	[batch](bool succeeded)
+	{
+		// The messages are durable now, so they can be delivered to the current participants of their chats
+		if (succeeded)
+		{
+			std::vector<uint64_t> deliveredChats;
+
+			for (size_t i = 0; i < batch->messages.size(); ++i)
+			{
+				const PendingChatMessage& pending = batch->messages[i];
+				// Find() loads the chat again if it has been evicted while the batch was being written
+				bool wasCached = sApp->chatDirectory->FindCached(pending.chatId) != nullptr;
+				const ChatDirectoryEntry* chat = sApp->chatDirectory->Find(pending.chatId);
+				if (!chat)
+				{
+					continue;
+				}
+
+				sApp->chatDirectory->SetLastMessage(pending.chatId, pending.messageId);
+				sApp->SendFrameToUsers(chat->participants, batch->frames[i]);
+
+				// The author has read their own message; the others can tell that from the message itself, so no receipt is sent.
+				// An author who has logged out in the meantime has had their read marks flushed already, so theirs is left alone.
+				if (pending.senderId != INVALID_USER_ID && wasCached && sApp->GetLoggedInClient(pending.senderId))
+				{
+					sApp->AdvanceReadWatermark(pending.chatId, pending.senderId);
+				}
+
+				if (std::find(deliveredChats.begin(), deliveredChats.end(), pending.chatId) == deliveredChats.end())
+				{
+					deliveredChats.push_back(pending.chatId);
+				}
+			}
+
+			// Participants who are looking at the chat have read the new messages right away
+			for (uint64_t chatId : deliveredChats)
+			{
+				const ChatDirectoryEntry* chat = sApp->chatDirectory->Find(chatId);
+				for (uint64_t participantId : chat->participants)
+				{
+					RemoteClient* client = sApp->GetLoggedInClient(participantId);
+					if (client && client->GetActiveChatID() == chatId)
+					{
+						sApp->SetChatReadByUser(chatId, participantId);
+					}
+				}
+			}
+		}
+
+		for (const std::weak_ptr<RemoteClient>& weakSender : batch->senders)
+		{
+			std::shared_ptr<RemoteClient> sender = weakSender.lock();
+			if (sender)
+			{
+				if (!succeeded)
+				{
+					sender->ShowMessageBox("Your message could not be sent, please try again.", false);
+				}
+
+				sender->EndDatabaseRequest();
+			}
+		}
+	});
 }
 
 void ServerSocketApp::AddFilePromise(uint64_t promiseId, uint64_t userId)
@@ -295,21 +867,53 @@ void ServerSocketApp::Run()
 {
 	LogInfo("Server is accepting connections");
 
+	this->nextHousekeepingTick = GetTickCount64() + HousekeepingIntervalMs;
+	this->nextCheckpointTick = GetTickCount64() + this->config.checkpointIntervalMs;
+	this->isCheckpointRunning = false;
+	this->nextPresenceFlushTick = GetTickCount64() + this->config.presenceFlushIntervalMs;
+
 	for (;;)
 	{
-		this->AcceptIncomingConnections();
-		this->UpdateConnections();
+		this->PreparePollDescriptors();
 
-		if (GetTickCount64() - lastSeenUpdatedTick > 1000)
+		// Sleep until a socket becomes ready or the housekeeping timer is due
+		int readyCount = WSAPoll(this->pollDescriptors.data(), (ULONG)this->pollDescriptors.size(), this->GetPollTimeout());
+		if (readyCount == SOCKET_ERROR)
 		{
-			this->UpdateLastSeenTimes();
-			this->UpdateReadReceipts();
-			this->UpdateParticipantLists();
+			LogError("WSAPoll() failed [error %u]", WSAGetLastError());
+			continue;
+		}
 
-			lastSeenUpdatedTick = GetTickCount64();
+		if (readyCount > 0 || this->hasBufferedPackets || this->hasOverflowedClients)
+		{
+			// Finished database requests go first, so that the clients waiting for them can process their packets in this pass
+			if (this->pollDescriptors[DatabaseWakeupPollIndex].revents & POLLRDNORM)
+			{
+				this->dbWorker->RunCompletions();
+			}
+
+			this->UpdateConnections();
+
+			// New clients are accepted after updating the existing ones, since they don't have a poll descriptor yet
+			if (this->pollDescriptors[ListeningSocketPollIndex].revents & POLLRDNORM)
+			{
+				this->AcceptIncomingConnections();
+			}
 		}
 
-		Sleep(15);
+		// Messages sent during this pass are submitted together, unless the batch may still wait for more of them
+		if (!this->pendingMessages.empty() && GetTickCount64() >= this->pendingMessagesDeadline)
+		{
+			this->FlushPendingMessages();
+		}
+
+		this->RunHousekeepingTimer();
+		this->RunCheckpointTimer();
+		this->RunPresenceTimer();
+
+		// Users who went offline during this pass (and everybody online, when the presence timer fires) are written together
+		this->FlushLastSeenTimes();
+		this->FlushReadMarks();
 	}
 }
 
@@ -3,42 +3,137 @@
 #include <WinSock2.h>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
+#include <functional>
 #include <unordered_map>
 
 #include "../Application.h"
+#include "../Packets/NetPacket.h"
+#include "ServerConfig.h"
+#include "DatabaseInterface.h"
 
 class RemoteClient;
 class DatabaseInterface;
+class DatabaseWorker;
+class ChatDirectory;
 
 enum class LoginResult : uint8_t;
-enum class ChatCreateResult : uint8_t;
+
+// Counters describing what the server did to protect itself from clients that don't keep up with their traffic
+struct ServerMetrics {
+	uint64_t slowConsumerFramesDropped = 0;
+	uint64_t slowConsumerFramesCoalesced = 0;
+	uint64_t slowConsumerDisconnects = 0;
+};
+
+// Poll descriptor indexes: the listening socket, the database worker's wakeup socket, and then all connected clients
+constexpr size_t ListeningSocketPollIndex = 0;
+constexpr size_t DatabaseWakeupPollIndex = 1;
+constexpr size_t FirstClientPollIndex = 2;
+
+// How often (in milliseconds) the periodic housekeeping tasks (participant lists, metrics) run
+constexpr uint64_t HousekeepingIntervalMs = 1000;
 
 class ServerSocketApp : public Application {
 private:
 	SOCKET serverSocket;
+	ServerConfig config;
+	ServerMetrics metrics;
+
+	// Counters as of the last time they were logged, so that only changes are logged
+	ServerMetrics loggedMetrics;
 	std::unique_ptr<DatabaseInterface> dbConnection;
-	std::vector<std::unique_ptr<RemoteClient>> connectedClients;
+	std::unique_ptr<DatabaseWorker> dbWorker;
+	std::unique_ptr<ChatDirectory> chatDirectory;
+
+	// Clients are shared so that database requests can hold weak references to them; only this list owns them
+	std::vector<std::shared_ptr<RemoteClient>> connectedClients;
 
 	std::unordered_map<uint64_t, uint64_t> promisesToUsersMapping;
 
-	uint64_t lastSeenUpdatedTick;
+	// Live login sessions, indexed by user ID and by username. Only the most recent session of a user is indexed,
+	// older ones are already being disconnected by CreateLoginSession().
+	std::unordered_map<uint64_t, RemoteClient*> loggedInClientsById;
+	std::unordered_map<std::string, RemoteClient*> loggedInClientsByName;
+
+	// Poll descriptors passed to WSAPoll(); index FirstClientPollIndex + i belongs to connectedClients[i]
+	std::vector<WSAPOLLFD> pollDescriptors;
+
+	// Tick at which the housekeeping timer fires next
+	uint64_t nextHousekeepingTick;
+
+	// Tick at which the next checkpoint is submitted to the database thread, and whether the previous one is still running
+	uint64_t nextCheckpointTick;
+	bool isCheckpointRunning;
+
+	// Tick at which the "last seen" times of all logged in users are stored next
+	uint64_t nextPresenceFlushTick;
+
+	// Users whose "last seen" time has to be stored with the next flush
+	std::vector<uint64_t> pendingLastSeenUsers;
+
+	// Read watermarks that have moved since the last flush; the current ones are kept by the chat directory
+	std::vector<ChatReadMark> pendingReadMarks;
+
+	// Users who have gone offline; their chats are evicted from the chat directory once the pending read marks are stored
+	std::vector<uint64_t> pendingEvictions;
+
+	// Set when some client still has complete packets buffered after running out of its per-update budget
+	bool hasBufferedPackets;
+	// Set when some client's send queue has overflowed (e.g. by a timer), so that it's dropped without waiting for its socket to be ready
+	bool hasOverflowedClients;
+
+	// Chat messages that have been sent, but not submitted for writing yet, along with their senders
+	std::vector<PendingChatMessage> pendingMessages;
+	std::vector<std::weak_ptr<RemoteClient>> pendingMessageSenders;
+
+	// Tick at which the pending messages have to be submitted at the latest
+	uint64_t pendingMessagesDeadline;
 
 	// When the server is in listening state, this function will accept all incoming connections and add them to a list.
 	void AcceptIncomingConnections();
-	
-	// Updates existing connections (calls recv(), processes incoming packets etc.)
+
+	// Rebuilds the poll descriptor list; write interest is only registered for clients that have data waiting to be sent
+	void PreparePollDescriptors();
+
+	// Returns how long WSAPoll() may block before the housekeeping timer is due
+	int GetPollTimeout();
+
+	// Updates existing connections that have been reported as ready by WSAPoll() (calls recv(), processes incoming packets etc.)
 	void UpdateConnections();
 
-	// Updates the "last seen" times of logged in users
-	void UpdateLastSeenTimes();
+	// Runs the periodic tasks below, if the housekeeping timer is due
+	void RunHousekeepingTimer();
+
+	// Logs the server metrics, if they have changed since they were logged last time
+	void LogMetrics();
+
+	// Has the database thread checkpoint the write-ahead log, if the checkpoint timer is due
+	void RunCheckpointTimer();
+
+	// Schedules the "last seen" times of all logged in users to be stored, if the presence timer is due
+	void RunPresenceTimer();
 
-	// Updates read receipts of logged in users
-	void UpdateReadReceipts();
+	// Has the database thread store the current time as "last seen" time of the pending users, in a single transaction
+	void FlushLastSeenTimes();
+
+	// Moves the user's read watermark to the latest message of the chat (in memory, stored with the next flush). Returns true if it has moved.
+	bool AdvanceReadWatermark(uint64_t chatId, uint64_t userId);
+
+	// Has the database thread store the pending read marks, in a single transaction, and then evicts the chats of users who have gone offline
+	void FlushReadMarks();
 
 	// Sends current chat participant lists to logged in users
 	void UpdateParticipantLists();
 
+	// Sends the participant list of a chat to those of the users who are currently viewing it
+	void SendParticipantListToViewers(const std::vector<uint64_t>& userIds, uint64_t chatId);
+
+	// Has the database thread write a change to a chat on behalf of a client, which doesn't process any further packets until it's done.
+	// apply runs on the network thread once the change has been committed, even if the client has been disconnected in the meantime.
+	void SubmitChatChange(RemoteClient* requester, std::function<void(DatabaseInterface*)> work, std::function<void()> apply, const char* failureMessage);
+
 	// Sets a socket as non-blocking and disables Nagle's algorithm for reduced latency.
 	void SetSocketNonBlocking(SOCKET s);
 
@@ -47,12 +142,43 @@ public:
 	virtual ~ServerSocketApp();
 
 	RemoteClient* GetLoggedInClient(uint64_t userId);
+
+	// Queues the same frame for every user from the list that is currently logged in
+	void SendFrameToUsers(const std::vector<uint64_t>& userIds, const SharedNetFrame& frame);
+
+	// Builds the participant list of a chat (with online users marked as such), ready to be shared by all of its viewers
+	SharedNetFrame CreateParticipantListFrame(uint64_t chatId);
 	inline DatabaseInterface* GetDB() { return dbConnection.get(); }
+	inline DatabaseWorker* GetDBWorker() { return dbWorker.get(); }
+	inline ChatDirectory* GetChatDirectory() { return chatDirectory.get(); }
+	inline const ServerConfig& GetConfig() { return config; }
+	inline ServerMetrics& GetMetrics() { return metrics; }
 
+	// Returns LoginResult::Failed if the user doesn't exist yet; new users have to be created on the database thread first
 	LoginResult CreateLoginSession(std::string username, uint64_t* userId);
-	ChatCreateResult CreateChat(uint64_t ownerUserId, std::vector<uint64_t> participants, bool isGroupChat);
+
+	// Adds a client that has just logged in to the session indexes
+	void RegisterLoginSession(RemoteClient* client);
+
+	// Removes a client from the session indexes (if it's still the indexed session of its user)
+	void UnregisterLoginSession(RemoteClient* client);
+
+	// Changes to chats are written by the database thread; the chat directory is updated and the participants are notified once they're committed
+	void CreateChat(RemoteClient* owner, std::vector<uint64_t> participants, bool isGroupChat);
+	void AddChatParticipant(RemoteClient* requester, uint64_t chatId, uint64_t userId);
+	void RemoveChatParticipant(RemoteClient* requester, uint64_t chatId, uint64_t userId);
+	void RenameChat(RemoteClient* requester, uint64_t chatId, std::string newName);
+
+	// Marks the chat as read by the user and sends a read receipt to its participants, unless it has been read already
 	void SetChatReadByUser(uint64_t chatId, uint64_t userId);
 
+	// Adds a message to the current batch; it's delivered to the chat participants once the batch is committed.
+	// The sender doesn't process any further packets until then.
+	void QueueChatMessage(RemoteClient* sender, uint64_t chatId, std::string_view message, uint64_t filePromiseId = 0);
+
+	// Submits the current batch of messages to the database thread, which commits it in a single transaction
+	void FlushPendingMessages();
+
 	void AddFilePromise(uint64_t promiseId, uint64_t userId);
 	uint64_t GetUserForFilePromise(uint64_t promiseId);
 
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "DatabaseInterface.h"
+
+// Tunable server settings. The defaults are meant for a single server handling a few thousand connections.
+struct ServerConfig {
+	// SQLite connection settings (path, journaling and caching)
+	DatabaseSettings database;
+
+	// How often (in milliseconds) the database thread checkpoints the write-ahead log into the database file
+	uint64_t checkpointIntervalMs = 5000;
+
+	// Online users are shown as such from memory; their "last seen" time is stored when they go offline,
+	// and for all online users every presenceFlushIntervalMs milliseconds, so that a crash doesn't lose more than that
+	uint64_t presenceFlushIntervalMs = 60000;
+
+	// Maximum number of packets processed for a single connection in one pass of the event loop,
+	// so that a chatty client cannot starve everybody else. Remaining packets are processed in the next pass.
+	size_t maxPacketsPerUpdate = 32;
+
+	// Chat messages are written to the database in batches, each with a single commit, and delivered once committed.
+	// A batch is handed to the database thread when it reaches messageBatchMaxSize messages, or when its oldest message has waited
+	// messageBatchMaxDelayMs milliseconds - with the default of 0, whatever was sent during one pass of the event loop is submitted at the end of that pass.
+	size_t messageBatchMaxSize = 256;
+	uint64_t messageBatchMaxDelayMs = 0;
+
+	// Number of messages sent when a chat is opened, and in every page of older history requested afterwards
+	size_t chatHistoryPageSize = 50;
+
+	// Once this many bytes are queued for a client, droppable traffic (periodic participant list refreshes)
+	// replaces the already queued copy or is skipped entirely.
+	size_t sendQueueSoftLimit = 1 * 1024 * 1024;
+
+	// A client that already has this many bytes queued when another frame is sent to it is considered stalled,
+	// and its connection is reset. Must be large enough to hold a file transfer.
+	size_t sendQueueHardLimit = 64 * 1024 * 1024;
+};